@@ -0,0 +1,502 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// A self-contained benchmark harness for quince_sqlite, built by `b2 bench`.  It runs a fixed
+// set of workloads against a temporary database file and against an in-memory database, under
+// each combination of the constructor's mutex and share_cache arguments, and writes the
+// timings as JSON, so that one release can be compared against another.
+//
+// Usage:
+//
+//      bench [scale [output-file]]
+//
+// scale (default 1) multiplies the number of rows in every workload.  Without output-file,
+// the JSON goes to stdout.
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/filesystem.hpp>
+#include <quince/quince.h>
+#include <quince/detail/session.h>
+#include <quince/detail/sql.h>
+#include <sqlite3.h>
+#include <quince_sqlite/blob.h>
+#include <quince_sqlite/bulk_insert.h>
+#include <quince_sqlite/database.h>
+#include <quince_sqlite/settings.h>
+
+using boost::posix_time::ptime;
+using std::string;
+using std::vector;
+
+
+struct item {
+    quince::serial id;
+    int64_t category;
+    int64_t value;
+    string name;
+};
+QUINCE_MAP_CLASS(item, (id)(category)(value)(name))
+
+struct stamp {
+    quince::serial id;
+    int64_t item_id;
+    ptime created;
+    ptime modified;
+    ptime expires;
+};
+QUINCE_MAP_CLASS(stamp, (id)(item_id)(created)(modified)(expires))
+
+struct artefact {
+    quince::serial id;
+    vector<uint8_t> payload;
+};
+QUINCE_MAP_CLASS(artefact, (id)(payload))
+
+struct page_key {
+    int64_t major;
+    int64_t minor;
+};
+QUINCE_MAP_CLASS(page_key, (major)(minor))
+
+struct entry {
+    page_key key;
+    int64_t payload;
+};
+QUINCE_MAP_CLASS(entry, (key)(payload))
+
+
+namespace {
+    typedef std::chrono::steady_clock clock;
+
+    struct configuration {
+        string _name;
+        bool _in_memory;
+        bool _mutex;
+        bool _share_cache;
+        quince_sqlite::ptime_storage _ptime_storage;
+    };
+
+    struct measurement {
+        string _configuration;
+        string _workload;
+        string _parameter;      // what distinguishes this run from others of the same workload, or ""
+        uint64_t _operations;
+        double _seconds;
+    };
+
+    const size_t blob_bytes = 1 << 20;
+    const size_t blob_chunk_bytes = 64 << 10;
+
+    // Deterministic, so that every run does the same work.
+    //
+    class pseudo_random {
+    public:
+        pseudo_random() : _state(88172645463325252ull) {}
+
+        int64_t next(int64_t bound) {
+            _state ^= _state << 13;
+            _state ^= _state >> 7;
+            _state ^= _state << 17;
+            return int64_t(_state % uint64_t(bound));
+        }
+
+    private:
+        uint64_t _state;
+    };
+
+    string
+    quoted(const string &s) {
+        string result = "\"";
+        for (const char c: s) {
+            if (c == '"'  ||  c == '\\')  result += '\\';
+            result += c;
+        }
+        return result + "\"";
+    }
+
+    ptime
+    epoch_plus(int64_t seconds) {
+        return ptime(boost::gregorian::date(2014, 1, 1)) + boost::posix_time::seconds(long(seconds));
+    }
+
+    quince::serial
+    make_serial(int64_t value) {
+        quince::serial result;
+        result.assign(value);
+        return result;
+    }
+
+    // Runs every workload against one database, and appends the timings to _results.
+    //
+    class bench_run {
+    public:
+        bench_run(const configuration &config, size_t scale, vector<measurement> &results) :
+            _config(config),
+            _rows(1000 * scale),
+            _results(results)
+        {}
+
+        void run(const quince_sqlite::database &db) {
+            quince::serial_table<item> items(db, "items", &item::id);
+            items.specify_index(items->value);
+            items.open();
+
+            quince::serial_table<stamp> stamps(db, "stamps", &stamp::id);
+            stamps.specify_index(stamps->created);
+            stamps.open();
+
+            quince::serial_table<artefact> artefacts(db, "artefacts", &artefact::id);
+            artefacts.open();
+
+            quince::table<entry> entries(db, "entries", &entry::key);
+            entries.open();
+
+            single_row_insert(items);
+            bulk_insert(db, items);
+            point_select(items);
+            range_scan(items);
+            ptime_rows(db, stamps);
+            join(items, stamps);
+            aggregation(items);
+            large_blobs(db, artefacts);
+            deep_page(db, entries);
+            fetch_sizes(db);
+        }
+
+    private:
+        template<typename Fn>
+        void measure(const string &workload, const string &parameter, uint64_t operations, Fn fn) {
+            const clock::time_point start = clock::now();
+            fn();
+            const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+            _results.push_back({ _config._name, workload, parameter, operations, seconds });
+        }
+
+        item make_item(size_t i) {
+            return { quince::serial(), int64_t(i % 100), _random.next(int64_t(_rows) * 10), "item " + std::to_string(i) };
+        }
+
+        // One implicit transaction per row.
+        //
+        void single_row_insert(const quince::serial_table<item> &items) {
+            const size_t n = _rows / 10;
+            vector<item> batch;
+            for (size_t i = 0; i < n; i++)  batch.push_back(make_item(i));
+
+            measure("single_row_insert", "", n, [&] {
+                for (const item &i: batch)  items.insert(i);
+            });
+        }
+
+        void bulk_insert(const quince_sqlite::database &db, const quince::serial_table<item> &items) {
+            for (const size_t rows_per_transaction: { size_t(100), size_t(1000), size_t(10000) }) {
+                vector<item> batch;
+                for (size_t i = 0; i < _rows; i++)  batch.push_back(make_item(i));
+
+                measure("bulk_insert", "rows_per_transaction=" + std::to_string(rows_per_transaction), _rows, [&] {
+                    quince_sqlite::bulk_insert(db, items, batch.begin(), batch.end(), rows_per_transaction);
+                });
+            }
+        }
+
+        void point_select(const quince::serial_table<item> &items) {
+            const size_t n = _rows / 10;
+            const int64_t id_bound = int64_t(_rows * 3 + _rows / 10);
+            uint64_t found = 0;
+            measure("point_select", "", n, [&] {
+                for (size_t i = 0; i < n; i++)
+                    for (const item &it: items.where(items->id == make_serial(1 + _random.next(id_bound))))
+                        found += (it.value >= 0);
+            });
+        }
+
+        // Reads about 1% of the table per query, through the index on value.
+        //
+        void range_scan(const quince::serial_table<item> &items) {
+            const size_t queries = 100;
+            const int64_t width = int64_t(_rows) / 10;
+            uint64_t rows_read = 0;
+            const clock::time_point start = clock::now();
+            for (size_t i = 0; i < queries; i++) {
+                const int64_t low = _random.next(int64_t(_rows) * 10 - width);
+                for (const item &it: items.where(items->value >= low  &&  items->value < low + width))
+                    rows_read += (it.value >= low);
+            }
+            const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+            _results.push_back({ _config._name, "range_scan", "rows_read=" + std::to_string(rows_read), queries, seconds });
+        }
+
+        // Three ptime columns per row, so that the cost of converting ptimes (which depends on
+        // settings::_ptime_storage) dominates.
+        //
+        void ptime_rows(const quince_sqlite::database &db, const quince::serial_table<stamp> &stamps) {
+            vector<stamp> batch;
+            for (size_t i = 0; i < _rows; i++) {
+                const int64_t t = int64_t(i) * 60;
+                batch.push_back({ quince::serial(), int64_t(1 + i), epoch_plus(t), epoch_plus(t + 30), epoch_plus(t + 86400) });
+            }
+            measure("ptime_insert", "", _rows, [&] {
+                quince_sqlite::bulk_insert(db, stamps, batch.begin(), batch.end());
+            });
+
+            const size_t queries = 100;
+            const int64_t span = int64_t(_rows) * 60;
+            uint64_t rows_read = 0;
+            measure("ptime_range_scan", "", queries, [&] {
+                for (size_t i = 0; i < queries; i++) {
+                    const int64_t low = _random.next(span - span / 10);
+                    for (const stamp &s: stamps.where(stamps->created >= epoch_plus(low)  &&  stamps->created < epoch_plus(low + span / 100)))
+                        rows_read += (s.expires > s.created);
+                }
+            });
+        }
+
+        void join(const quince::serial_table<item> &items, const quince::serial_table<stamp> &stamps) {
+            uint64_t rows_read = 0;
+            const clock::time_point start = clock::now();
+            for (const std::tuple<item, stamp> &row: quince::inner_join(items, stamps, items->id == stamps->item_id))
+                rows_read += (std::get<0>(row).value >= 0);
+            const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+            _results.push_back({ _config._name, "join", "", rows_read, seconds });
+        }
+
+        void aggregation(const quince::serial_table<item> &items) {
+            const size_t queries = 20;
+            uint64_t rows_read = 0;
+            measure("aggregation", "count", queries, [&] {
+                for (size_t i = 0; i < queries; i++)
+                    for (const auto &c: items.select(quince::count_all()))
+                        rows_read += (c > 0);
+            });
+            measure("aggregation", "sum", queries, [&] {
+                for (size_t i = 0; i < queries; i++)
+                    for (const auto &s: items.where(items->category < 50).select(quince::sum(items->value)))
+                        rows_read += bool(s);
+            });
+        }
+
+        // Whole values through quince, versus chunks through a blob handle.
+        //
+        void large_blobs(const quince_sqlite::database &db, const quince::serial_table<artefact> &artefacts) {
+            const size_t n = _rows / 100;
+            const quince::binomen table = { boost::none, "artefacts" };
+            const string size = "bytes=" + std::to_string(blob_bytes);
+            vector<uint8_t> chunk(blob_chunk_bytes);
+            vector<int64_t> ids;
+
+            artefact a;
+            a.payload.resize(blob_bytes);
+            for (size_t i = 0; i < blob_bytes; i++)  a.payload[i] = uint8_t(i * 31);
+            measure("blob_insert", size, n, [&] {
+                for (size_t i = 0; i < n; i++)  ids.push_back(artefacts.insert(a).value());
+            });
+
+            uint64_t bytes_read = 0;
+            measure("blob_select", size, n, [&] {
+                for (const artefact &r: artefacts)  bytes_read += r.payload.size();
+            });
+
+            measure("blob_handle_read", size, n, [&] {
+                quince_sqlite::blob handle(db, table, "payload", ids.front());
+                for (const int64_t id: ids) {
+                    handle.reopen(id);
+                    for (size_t offset = 0; offset < handle.size(); offset += chunk.size())
+                        handle.read(chunk.data(), chunk.size(), offset);
+                }
+            });
+
+            measure("blob_handle_write", size, n, [&] {
+                quince::transaction txn(db);
+                for (const int64_t id: ids)
+                    quince_sqlite::blob::preallocate(db, table, "payload", id, blob_bytes);
+                quince_sqlite::blob handle(db, table, "payload", ids.front(), true);
+                for (const int64_t id: ids) {
+                    handle.reopen(id);
+                    for (size_t offset = 0; offset < blob_bytes; offset += chunk.size())
+                        handle.write(chunk.data(), chunk.size(), offset);
+                }
+                txn.commit();
+            });
+        }
+
+        // Fetching a page near the end of a table ordered by a two-column key: by skipping
+        // over everything before it, versus by a keyset condition on the last key of the
+        // previous page, which is a collective comparison (a row-value comparison, on SQLite
+        // 3.15 and later).
+        //
+        void deep_page(const quince_sqlite::database &db, const quince::table<entry> &entries) {
+            const int64_t minors = 100;
+            const int64_t majors = int64_t(_rows) / minors * 10;
+            vector<entry> batch;
+            for (int64_t major = 0; major < majors; major++)
+                for (int64_t minor = 0; minor < minors; minor++)
+                    batch.push_back({ { major, minor }, major * minors + minor });
+            quince_sqlite::bulk_insert(db, entries, batch.begin(), batch.end());
+
+            const size_t queries = 20;
+            const uint32_t page = 50;
+            const int64_t depth = majors * minors * 9 / 10;
+            const page_key previous = { (depth - 1) / minors, (depth - 1) % minors };
+            const string parameter = "depth=" + std::to_string(depth);
+            uint64_t rows_read = 0;
+
+            measure("deep_page_offset", parameter, queries, [&] {
+                for (size_t i = 0; i < queries; i++)
+                    for (const entry &e: entries.order(entries->key).skip(depth).limit(page))
+                        rows_read += (e.payload >= depth);
+            });
+            measure("deep_page_keyset", parameter, queries, [&] {
+                for (size_t i = 0; i < queries; i++)
+                    for (const entry &e: entries.where(entries->key > previous).order(entries->key).limit(page))
+                        rows_read += (e.payload >= depth);
+            });
+        }
+
+        // Rows per second through a result stream, for several fetch sizes, i.e. how many rows
+        // the session prefetches at a time (see session_impl::exec_with_stream_output()).  quince
+        // doesn't let a query choose its fetch size, so this goes to the session directly.  It
+        // scans the entries table, which deep_page() fills with ten rows per _rows.
+        //
+        void fetch_sizes(const quince_sqlite::database &db) {
+            const size_t passes = 10;
+            const quince::session session = db.get_session();
+            const std::unique_ptr<quince::sql> cmd = db.make_sql();
+            cmd->write("SELECT * FROM \"entries\"");
+
+            for (const uint32_t fetch_size: { 1u, 10u, 100u, 1000u }) {
+                uint64_t rows_read = 0;
+                const clock::time_point start = clock::now();
+                for (size_t i = 0; i < passes; i++) {
+                    const quince::result_stream stream = session->exec_with_stream_output(*cmd, fetch_size);
+                    while (session->next_output(stream))  rows_read++;
+                }
+                const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+                _results.push_back({ _config._name, "stream_scan", "fetch_size=" + std::to_string(fetch_size), rows_read, seconds });
+            }
+        }
+
+        const configuration _config;
+        const size_t _rows;
+        vector<measurement> &_results;
+        pseudo_random _random;
+    };
+
+    void
+    remove_database_files(const boost::filesystem::path &path) {
+        boost::system::error_code ignored;
+        for (const char *suffix: { "", "-journal", "-wal", "-shm" })
+            boost::filesystem::remove(path.string() + suffix, ignored);
+    }
+
+    // ":memory:" gives each connection a database of its own, whatever share_cache says, so
+    // for a shared cache in memory we need a named in-memory database, which only a URI can give.
+    //
+    string
+    filename_for(const configuration &config, const boost::filesystem::path &path) {
+        if (! config._in_memory)    return path.string();
+        if (! config._share_cache)  return ":memory:";
+        return "file:" + path.stem().string() + "?mode=memory&cache=shared";
+    }
+
+    void
+    run_configuration(const configuration &config, size_t scale, vector<measurement> &results) {
+        const boost::filesystem::path path =
+            boost::filesystem::temp_directory_path()
+            / boost::filesystem::unique_path("quince_sqlite-bench-%%%%-%%%%-%%%%.db");
+        const string filename = filename_for(config, path);
+
+        quince_sqlite::settings s;
+        s._ptime_storage = config._ptime_storage;
+        {
+            const quince_sqlite::database db(
+                filename, true, config._mutex, config._share_cache,
+                boost::none, boost::none, quince_sqlite::database::filename_map(), s
+            );
+            bench_run(config, scale, results).run(db);
+        }
+        if (! config._in_memory)  remove_database_files(path);
+    }
+
+    vector<configuration>
+    all_configurations() {
+        vector<configuration> result;
+        for (const bool in_memory: { false, true })
+            for (const bool mutex: { true, false })
+                for (const bool share_cache: { false, true }) {
+                    const string name =
+                        string(in_memory ? "memory" : "file")
+                        + (mutex ? "/mutex" : "/nomutex")
+                        + (share_cache ? "/shared" : "/private");
+                    result.push_back({ name + "/ptime_text", in_memory, mutex, share_cache, quince_sqlite::ptime_storage::text });
+                }
+
+        for (const bool in_memory: { false, true }) {
+            const string name = string(in_memory ? "memory" : "file") + "/mutex/private/ptime_integer";
+            result.push_back({ name, in_memory, true, false, quince_sqlite::ptime_storage::integer });
+        }
+        return result;
+    }
+
+    void
+    write_json(std::ostream &out, size_t scale, const vector<measurement> &results) {
+        out << "{\n"
+            << "  \"sqlite_version\": " << quoted(sqlite3_libversion()) << ",\n"
+            << "  \"scale\": " << scale << ",\n"
+            << "  \"results\": [";
+        for (size_t i = 0; i < results.size(); i++) {
+            const measurement &m = results[i];
+            out << (i == 0 ? "\n" : ",\n")
+                << "    {"
+                << " \"configuration\": " << quoted(m._configuration) << ","
+                << " \"workload\": " << quoted(m._workload) << ","
+                << " \"parameter\": " << quoted(m._parameter) << ","
+                << " \"operations\": " << m._operations << ","
+                << " \"seconds\": " << m._seconds << ","
+                << " \"operations_per_second\": " << (m._seconds > 0 ? double(m._operations) / m._seconds : 0.0)
+                << " }";
+        }
+        out << "\n  ]\n}\n";
+    }
+}
+
+
+int
+main(int argc, char **argv) {
+    const size_t scale = argc > 1 ? size_t(strtoul(argv[1], nullptr, 10)) : 1;
+    if (scale == 0) {
+        std::cerr << "usage: " << argv[0] << " [scale [output-file]]\n";
+        return 2;
+    }
+
+    vector<measurement> results;
+    try {
+        for (const configuration &config: all_configurations()) {
+            std::cerr << config._name << "\n";
+            run_configuration(config, scale, results);
+        }
+    }
+    catch (const std::exception &e) {
+        std::cerr << "bench: " << e.what() << "\n";
+        return 1;
+    }
+
+    if (argc > 2) {
+        std::ofstream out(argv[2]);
+        write_json(out, scale, results);
+        return out ? 0 : 1;
+    }
+    write_json(std::cout, scale, results);
+    return 0;
+}
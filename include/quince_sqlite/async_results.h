@@ -0,0 +1,176 @@
+#ifndef QUINCE_SQLITE__async_results_h
+#define QUINCE_SQLITE__async_results_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <quince_sqlite/database.h>
+
+
+namespace quince_sqlite {
+
+// What passes between a query running on an executor and its async_results: batches of
+// results one way, and abandonment the other.  Both sides hold it, so that it outlives
+// whichever of them finishes first.  For async_results' and submit_query()'s use only.
+//
+template<typename Value>
+class async_results_channel : private boost::noncopyable {
+public:
+    explicit async_results_channel(size_t max_pending_batches) :
+        _max_pending_batches(max_pending_batches),
+        _finished(false),
+        _abandoned(false)
+    {
+        assert(max_pending_batches > 0);
+    }
+
+    bool
+    next_batch(std::vector<Value> &dest) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _changed.wait(lock, [this] { return ! _pending.empty()  ||  _finished; });
+        if (_pending.empty()) {
+            if (_failure)  std::rethrow_exception(_failure);
+            return false;
+        }
+        dest = std::move(_pending.front());
+        _pending.pop_front();
+        lock.unlock();
+        _changed.notify_all();
+        return true;
+    }
+
+    void
+    abandon() {
+        {
+            const std::lock_guard<std::mutex> lock(_mutex);
+            _abandoned = true;
+        }
+        _changed.notify_all();
+    }
+
+    // Returns false if the consumer has abandoned the results.
+    //
+    bool
+    deliver(std::vector<Value> &&batch) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _changed.wait(lock, [this] { return _pending.size() < _max_pending_batches  ||  _abandoned; });
+        if (_abandoned)  return false;
+        _pending.push_back(std::move(batch));
+        lock.unlock();
+        _changed.notify_all();
+        return true;
+    }
+
+    void
+    finish(std::exception_ptr failure = nullptr) {
+        {
+            const std::lock_guard<std::mutex> lock(_mutex);
+            _finished = true;
+            _failure = failure;
+        }
+        _changed.notify_all();
+    }
+
+private:
+    const size_t _max_pending_batches;
+    std::deque<std::vector<Value>> _pending;
+    bool _finished;
+    bool _abandoned;
+    std::exception_ptr _failure;
+    std::mutex _mutex;
+    std::condition_variable _changed;
+};
+
+
+
+// The results of a query that is running on an executor, delivered in batches as the executor
+// fetches them.  The executor stops fetching whenever max_pending_batches are waiting to be
+// taken, so a slow consumer holds back the query rather than filling memory.  Destroying the
+// async_results abandons them, so a consumer that stops early, e.g. because of an exception,
+// doesn't leave the executor waiting forever for room to deliver.
+//
+template<typename Value>
+class async_results : private boost::noncopyable {
+public:
+    explicit async_results(const std::shared_ptr<async_results_channel<Value>> &channel) :
+        _channel(channel)
+    {}
+
+    ~async_results() {
+        _channel->abandon();
+    }
+
+    // Blocks until a batch is available, moves it into dest, and returns true.  Returns false
+    // once all the results have been delivered.  If the query failed, rethrows its exception,
+    // after the batches fetched before the failure.
+    //
+    bool
+    next_batch(std::vector<Value> &dest) {
+        return _channel->next_batch(dest);
+    }
+
+    // Tells the executor to stop fetching at its next batch.
+    //
+    void
+    abandon() {
+        _channel->abandon();
+    }
+
+private:
+    const std::shared_ptr<async_results_channel<Value>> _channel;
+};
+
+
+// Runs a copy of query on one of db's executors, and returns its results as they come.  If db
+// has no executors, the query runs to completion before this returns, with no limit on the
+// batches pending.
+//
+template<typename Query>
+std::shared_ptr<async_results<typename std::decay<decltype(*std::declval<const Query &>().begin())>::type>>
+submit_query(const database &db, const Query &query, size_t batch_size = 100, size_t max_pending_batches = 4) {
+    typedef typename std::decay<decltype(*std::declval<const Query &>().begin())>::type value_type;
+    assert(batch_size > 0);
+
+    const auto channel = std::make_shared<async_results_channel<value_type>>(
+        db.executor_count() == 0 ? SIZE_MAX : max_pending_batches
+    );
+    const auto results = std::make_shared<async_results<value_type>>(channel);
+    db.post([channel, query, batch_size] {
+        try {
+            std::vector<value_type> batch;
+            batch.reserve(batch_size);
+            for (const value_type &v: query) {
+                batch.push_back(v);
+                if (batch.size() == batch_size) {
+                    if (! channel->deliver(std::move(batch)))  break;
+                    batch.clear();
+                    batch.reserve(batch_size);
+                }
+            }
+            if (! batch.empty())  channel->deliver(std::move(batch));
+            channel->finish();
+        }
+        catch (...) {
+            channel->finish(std::current_exception());
+        }
+    });
+    return results;
+}
+
+}
+
+#endif
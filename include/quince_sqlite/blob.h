@@ -0,0 +1,80 @@
+#ifndef QUINCE_SQLITE__blob_h
+#define QUINCE_SQLITE__blob_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <boost/noncopyable.hpp>
+#include <quince/detail/binomen.h>
+
+struct sqlite3_blob;
+
+
+namespace quince_sqlite {
+
+class connection;
+class database;
+
+// A handle on one byte_vector value in the database, which can be read or written a chunk at a
+// time, so that a large value never has to be in memory all at once.  See
+// https://sqlite.org/c3ref/blob_open.html.
+//
+// The value is identified by its table, its column, and the rowid of its record.  For a
+// quince::serial_table, the rowid is the serial.
+//
+// The handle uses the calling thread's connection (or, with a connection pool, holds a
+// reader, or the writer, until it is destroyed).  A write can't change the value's size: to
+// store a value of a given size, first use preallocate(), then write it in chunks.
+//
+class blob : private boost::noncopyable {
+public:
+    blob(
+        const database &,
+        const quince::binomen &table,
+        const std::string &column,
+        int64_t rowid,
+        bool writable = false
+    );
+
+    ~blob();
+
+    size_t size() const;
+
+    // Each of these throws quince::dbms_exception if [offset, offset+n) isn't within the value,
+    // or if the record has been changed or deleted since the handle was opened or reopened.
+    //
+    void read(void *dest, size_t n, size_t offset) const;
+    void write(const void *src, size_t n, size_t offset);
+
+    // Points the handle at the same column in another record, which is much cheaper than
+    // opening a new handle.
+    //
+    void reopen(int64_t rowid);
+
+    // Sets the value in the given record to size zero bytes, without ever having those bytes
+    // in memory.
+    //
+    static void preallocate(
+        const database &,
+        const quince::binomen &table,
+        const std::string &column,
+        int64_t rowid,
+        size_t size
+    );
+
+private:
+    void check(int result_code) const;
+
+    const std::shared_ptr<connection> _connection;
+    sqlite3_blob *_handle;
+};
+
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef QUINCE_SQLITE__bulk_insert_h
+#define QUINCE_SQLITE__bulk_insert_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stddef.h>
+#include <stdexcept>
+#include <quince/transaction.h>
+#include <quince_sqlite/database.h>
+
+
+namespace quince_sqlite {
+
+// Inserts the records in [first, last) into table, committing once per rows_per_transaction
+// records instead of once per record.  Every insert generates the same SQL text, so after the
+// first one each insert reuses the connection's cached prepared statement, and all that remains
+// per record is binding and stepping.
+//
+// If an insert fails, the exception propagates, the current chunk is rolled back, and chunks
+// that were already committed stay committed.  If the caller already has a transaction open
+// then each chunk becomes a savepoint within it, and nothing is committed until the caller
+// commits.
+//
+// Throws std::invalid_argument if rows_per_transaction is 0.
+//
+template<typename Table, typename InputIterator>
+void
+bulk_insert(
+    const database &db,
+    const Table &table,
+    InputIterator first,
+    InputIterator last,
+    size_t rows_per_transaction = 10000
+) {
+    if (rows_per_transaction == 0)  throw std::invalid_argument("rows_per_transaction must be positive");
+    while (first != last) {
+        quince::transaction txn(db);
+        for (size_t n = 0; n < rows_per_transaction  &&  first != last; ++n, ++first)
+            table.insert(*first);
+        txn.commit();
+    }
+}
+
+// Like bulk_insert(), but for a table whose insert() returns the generated serial (e.g. a
+// quince::serial_table).  The serials are written to dest, in the order of the records, and
+// the end of the output range is returned.
+//
+template<typename Table, typename InputIterator, typename OutputIterator>
+OutputIterator
+bulk_insert_with_readback(
+    const database &db,
+    const Table &table,
+    InputIterator first,
+    InputIterator last,
+    OutputIterator dest,
+    size_t rows_per_transaction = 10000
+) {
+    if (rows_per_transaction == 0)  throw std::invalid_argument("rows_per_transaction must be positive");
+    while (first != last) {
+        quince::transaction txn(db);
+        for (size_t n = 0; n < rows_per_transaction  &&  first != last; ++n, ++first)
+            *dest++ = table.insert(*first);
+        txn.commit();
+    }
+    return dest;
+}
+
+}
+
+#endif
@@ -6,12 +6,31 @@
 //    (See accompanying file ../../LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 
+#include <atomic>
+#include <functional>
+#include <future>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <type_traits>
+#include <vector>
 #include <boost/optional.hpp>
 #include <boost/filesystem/path.hpp>
 #include <quince/database.h>
+#include <quince/exprn_mappers/detail/exprn_mapper.h>
 #include <quince/mapping_customization.h>
+#include <quince_sqlite/settings.h>
+#include <quince_sqlite/detail/backup.h>
+#include <quince_sqlite/detail/change_feed.h>
+#include <quince_sqlite/detail/checkpointer.h>
+#include <quince_sqlite/detail/commit_coordinator.h>
+#include <quince_sqlite/detail/connection_pool.h>
+#include <quince_sqlite/detail/executor.h>
+#include <quince_sqlite/detail/instrumented_vfs.h>
+#include <quince_sqlite/detail/query_plan_advisor.h>
 #include <quince_sqlite/detail/session.h>
+#include <quince_sqlite/detail/statement_profiler.h>
 
 
 namespace quince_sqlite {
@@ -32,11 +51,139 @@ public:
         bool share_cache = true,
         boost::optional<std::string> vfs_module_name = boost::none,
         const boost::optional<quince::mapping_customization> &customization_for_db = boost::none,
-        const filename_map &attachable_database_filenames = filename_map()
+        const filename_map &attachable_database_filenames = filename_map(),
+        const settings &tuning = settings()
     );
 
     virtual ~database();
 
+    // Prepared-statement cache counters for the calling thread's connection.
+    //
+    statement_cache_statistics get_statement_cache_statistics() const;
+
+    // Waits on locked databases by all this database's connections, as governed by settings::_busy.
+    //
+    busy_statistics get_busy_statistics() const;
+
+    // Migrates a column from the TEXT form of ptime to the INTEGER form (see ptime_integer_mapper.h),
+    // in a single transaction, and returns the number of rows changed.  Values that are already
+    // integers are left alone, so it's safe to run again after an interruption.
+    //
+    uint64_t convert_ptime_column_to_integer(const quince::binomen &table, const std::string &column) const;
+
+    // Statement profiles collected since construction or the last reset_statement_profiles(),
+    // keyed by normalised SQL text.  Empty unless settings::_profile_statements is true.
+    //
+    std::map<std::string, statement_profile> get_statement_profiles() const;
+
+    // The same, as a JSON array, heaviest total step time first.
+    //
+    void write_statement_profiles_json(std::ostream &) const;
+
+    void reset_statement_profiles() const;
+
+    // Creates a partial index, i.e. one that only covers the rows for which predicate is true,
+    // unless an index called index_name already exists.  The key is given the same way as to
+    // quince's specify_index(), and may include expressions, e.g.:
+    //
+    //      db.create_partial_index(people.get_binomen(), "active_people_by_name", { &people->name }, people->active);
+    //
+    // predicate is written the same way as a query's where() condition, in terms of the table's
+    // columns.  SQLite doesn't allow bound parameters in an index, and quince binds every
+    // constant, so if the predicate or a key expression has a constant in it, this throws
+    // quince::unsupported_exception.
+    //
+    void create_partial_index(
+        const quince::binomen &table,
+        const std::string &index_name,
+        const std::vector<const quince::abstract_mapper_base *> &key,
+        const quince::abstract_predicate &predicate,
+        bool unique = false
+    ) const;
+
+    // Runs fn() on one of the executor threads (see settings::_executor_threads), and returns
+    // a future for its result, or for the exception it throws.  Jobs are shared out round
+    // robin, and each executor runs its jobs back to back, in the order submitted.  So fn
+    // should contain everything that must happen on one connection, such as a whole
+    // transaction.  See also async_results.h, for queries whose results should arrive
+    // incrementally.
+    //
+    template<typename Fn>
+    std::future<typename std::result_of<Fn()>::type>
+    submit(Fn fn) const {
+        typedef typename std::result_of<Fn()>::type result_type;
+        const auto task = std::make_shared<std::packaged_task<result_type()>>(std::move(fn));
+        std::future<result_type> result = task->get_future();
+        post([task] { (*task)(); });
+        return result;
+    }
+
+    // Runs unit, which should make a few writes with quince, in a transaction.  With
+    // settings::_group_commit enabled, the transaction is shared with units from other threads,
+    // and the future becomes ready after the shared commit.  Otherwise unit runs in a
+    // transaction of its own, before this returns.  Either way, if unit throws, its writes
+    // are rolled back and the future holds the exception.
+    //
+    std::future<void> submit_write(std::function<void()> unit) const;
+
+    // Empty unless settings::_group_commit is enabled.
+    //
+    group_commit_statistics get_group_commit_statistics() const;
+
+    // Copies the database, or one of its enclosures, to destination_filename while other
+    // connections carry on reading and writing it, using SQLite's online backup API.  It runs
+    // on a connection of its own, paced as options say.  Returns false if options._on_progress
+    // abandoned the backup, in which case destination_filename is left incomplete.
+    //
+    bool backup(
+        const std::string &destination_filename,
+        const backup_options &options = backup_options(),
+        const boost::optional<std::string> &enclosure = boost::none
+    ) const;
+
+    // Writes an image of the database, or of one of its enclosures, to image_filename, as of
+    // its latest commit.  This is the form that settings::_load_image loads.
+    //
+    void write_image(const std::string &image_filename, const boost::optional<std::string> &enclosure = boost::none) const;
+
+    // I/O counters and latencies for every file opened through quince_sqlite's instrumented
+    // VFS, by this database or any other in the process, keyed by filename.  Empty unless some
+    // database has settings::_instrument_io.
+    //
+    std::map<std::string, file_io_statistics> get_io_statistics() const;
+
+    // Registers subscriber to be called after each commit of a transaction that changed any
+    // rows, with what it changed, and returns an id for unsubscribe_from_changes().  It is
+    // called on the thread that committed, after the commit, so it sees the committed state,
+    // and should be quick.  Nothing is delivered unless settings::_change_capture is on.
+    //
+    uint64_t subscribe_to_changes(change_subscriber subscriber) const;
+
+    void unsubscribe_from_changes(uint64_t subscription) const;
+
+    // Applies a changeset captured from another database (see committed_changes::_changeset)
+    // to the main database, on the calling thread's session, all or nothing.  So a replica
+    // can be kept up to date one transaction at a time, instead of being copied afresh.
+    //
+    void apply_changeset(
+        const std::string &changeset,
+        changeset_conflict on_conflict = changeset_conflict::abort
+    ) const;
+
+    // boost::none unless settings::_pooled_readers was non-zero.
+    //
+    boost::optional<connection_pool_statistics> get_connection_pool_statistics() const;
+
+    // Everything in the query plans that suggests a missing index, in the order found, since
+    // construction or the last reset_query_plan_findings().  Empty unless
+    // settings::_advise_query_plans is true.
+    //
+    std::vector<query_plan_finding> get_query_plan_findings() const;
+
+    // Also forgets which statements have been examined, so they will be examined again.
+    //
+    void reset_query_plan_findings() const;
+
 
     // --- Everything from here to end of class is for quince internal use only. ---
 
@@ -50,17 +197,79 @@ public:
 
     virtual bool supports_join(quince::conditional_junction_type) const override;
     virtual bool supports_combination(quince::combination_type, bool all) const override;
-    virtual bool supports_nested_combinations() const override                              { return false; }
+    virtual bool supports_nested_combinations() const override                              { return true; }
     virtual bool supports_index(const quince::index_spec &) const override;
     virtual bool imposes_combination_precedence() const override                            { return false; }
 
     std::unique_ptr<dialect_sql> make_dialect_sql() const;
 
+    void note_activity() const;
+
+    statement_profiler *get_statement_profiler() const  { return _statement_profiler.get(); }
+
+    // The enclosures that sql_text refers to, out of those that have been made available.
+    //
+    std::vector<attachment> enclosures_used_by(const std::string &sql_text) const;
+
+    query_plan_advisor *get_query_plan_advisor() const  { return _query_plan_advisor.get(); }
+
+    // Hands job to the next executor, or runs it now if there are none.  job must not throw.
+    //
+    void post(std::function<void()> &&job) const;
+
+    size_t executor_count() const                       { return _executors.size(); }
+
+    // The calling thread's session's connection, for use outside quince: see session_impl::checkout().
+    // If enclosure is given, it is attached.
+    //
+    std::shared_ptr<connection> checkout_connection(const boost::optional<std::string> &enclosure, bool writable) const;
+
 private:
     std::shared_ptr<session_impl> get_session_impl() const;
 
+    boost::filesystem::path enclosure_filename(const std::string &enclosure_name) const;
+
+    // The column titles of every table in one schema, as of one schema_version.
+    //
+    struct schema_metadata {
+        int64_t _schema_version;
+        std::map<std::string, std::vector<std::string>> _column_titles;
+    };
+
+    int64_t retrieve_schema_version(const boost::optional<std::string> &enclosure) const;
+
+    schema_metadata retrieve_all_metadata(const boost::optional<std::string> &enclosure, int64_t schema_version) const;
+
+    // A connection of our own, not shared with any session, with enclosure attached if given.
+    //
+    std::unique_ptr<connection> open_side_connection(const boost::optional<std::string> &enclosure) const;
+
+    mutable busy_counters _busy_counters;
+    mutable change_feed _change_feed;
     const session_impl::spec _spec;
+    const std::unique_ptr<connection> _image;     // holds the loaded image, if settings::_load_image
     const std::map<std::string, boost::filesystem::path> _attachable_database_absolute_filenames;
+
+    // Enclosures that quince has asked for, which each connection attaches when it first needs them.
+    //
+    mutable std::map<std::string, attachment> _available_enclosures;
+    mutable std::atomic<size_t> _available_enclosure_count;
+    mutable std::mutex _available_enclosures_mutex;
+
+    // Keyed by enclosure name, or "" for the main database.
+    //
+    mutable std::map<std::string, schema_metadata> _metadata_cache;
+    mutable std::mutex _metadata_cache_mutex;
+    const std::unique_ptr<connection_pool> _pool;
+    const std::unique_ptr<checkpointer> _checkpointer;
+    const std::unique_ptr<statement_profiler> _statement_profiler;
+    const std::unique_ptr<query_plan_advisor> _query_plan_advisor;
+    std::unique_ptr<commit_coordinator> _commit_coordinator;
+
+    // Last, so that the executors, and their sessions, are gone before anything they use.
+    //
+    std::vector<std::unique_ptr<executor>> _executors;
+    mutable std::atomic<size_t> _next_executor;
 };
 
 }
@@ -0,0 +1,45 @@
+#ifndef QUINCE_SQLITE__detail__backup_h
+#define QUINCE_SQLITE__detail__backup_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <chrono>
+#include <functional>
+#include <string>
+
+struct sqlite3;
+
+
+namespace quince_sqlite {
+
+struct backup_progress {
+    int _remaining_pages;
+    int _total_pages;
+};
+
+// How database::backup() paces itself.  It copies _pages_per_step pages at a time, and sleeps
+// for _pause between steps, so that it never holds the source's read lock for long.  If the
+// source is written to in the meantime (by another connection), SQLite starts the copy again
+// by itself.
+//
+struct backup_options {
+    int _pages_per_step = 256;
+    std::chrono::milliseconds _pause = std::chrono::milliseconds(10);
+
+    // Called after each step.  Returning false abandons the backup.
+    //
+    std::function<bool(const backup_progress &)> _on_progress;
+};
+
+// Copies schema of source into the main database of dest, a step at a time, as options say.
+// Returns false if _on_progress abandoned the copy, or else true.  Throws quince::dbms_exception
+// if the copy fails.
+//
+bool run_backup(sqlite3 *source, const std::string &schema, sqlite3 *dest, const backup_options &options);
+
+}
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef QUINCE_SQLITE__detail__change_feed_h
+#define QUINCE_SQLITE__detail__change_feed_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <quince/detail/binomen.h>
+
+struct sqlite3;
+struct sqlite3_session;
+struct sqlite3_stmt;
+
+
+namespace quince_sqlite {
+
+enum class change_operation { insert, update, remove };
+
+// One row that a committed transaction inserted, updated or removed.  For a
+// quince::serial_table, _rowid is the serial.
+//
+struct row_change {
+    quince::binomen _table;
+    change_operation _operation;
+    int64_t _rowid;
+};
+
+// Everything that one transaction changed, in the order it was changed, so a row that was
+// changed more than once appears more than once.
+//
+// _changeset is empty unless settings::_change_capture is feed_and_changesets.  Then it holds
+// the transaction's changes to the main database (not to enclosures) as an SQLite changeset
+// (see https://sqlite.org/sessionintro.html), which database::apply_changeset() can apply to
+// a replica.
+//
+struct committed_changes {
+    std::vector<row_change> _changes;
+    std::string _changeset;
+};
+
+typedef std::function<void(const committed_changes &)> change_subscriber;
+
+// What apply_changeset() does with a change that doesn't fit the target database, e.g. an
+// update to a row whose values aren't what the changeset says they were beforehand: abandon
+// the whole changeset, skip the change, or (where SQLite allows it) force it through.
+//
+enum class changeset_conflict { abort, omit, replace };
+
+
+// The subscribers to one database's changes.
+//
+class change_feed : private boost::noncopyable {
+public:
+    change_feed();
+
+    // Returns an id for unsubscribe().
+    //
+    uint64_t subscribe(change_subscriber);
+
+    void unsubscribe(uint64_t subscription);
+
+    // Calls every subscriber, on the calling thread.  An exception from a subscriber is
+    // swallowed: the commit has already happened, so it mustn't look as if it failed.
+    //
+    void publish(const committed_changes &) const;
+
+private:
+    mutable std::mutex _mutex;
+    std::map<uint64_t, std::shared_ptr<const change_subscriber>> _subscribers;
+    uint64_t _next_subscription;
+};
+
+
+// Watches one connection, through SQLite's update, commit and rollback hooks, and publishes
+// each of its transactions to a change_feed once the transaction has committed.  Changes that
+// are undone, by a failed statement, a ROLLBACK TO or a rollback, are never published.
+//
+// The hooks only report what happened, not what the transaction will end up as, so the
+// connection must tell us about every statement it runs, before and after, and we follow the
+// savepoints.
+//
+// With changesets, a session object (see https://sqlite.org/session/session.html) records the
+// main database's changes too.  Its changeset has to be taken before the commit, because SQLite
+// doesn't allow it in the commit hook, and afterwards another connection may have changed the
+// rows.  So a data-changing statement that would otherwise commit by itself is run inside a
+// savepoint of ours, and for an explicit transaction we take the changeset just before the
+// statement that commits it.
+//
+class change_recorder : private boost::noncopyable {
+public:
+    change_recorder(sqlite3 *conn, change_feed &, bool with_changesets);
+
+    ~change_recorder();
+
+    // Called before a statement is first stepped.  stmt is null if sql_text is being run by
+    // sqlite3_exec().
+    //
+    void before_statement(const char *sql_text, sqlite3_stmt *stmt);
+
+    // Called when a step returns anything but SQLITE_ROW.
+    //
+    void after_statement(const char *sql_text, int result_code);
+
+private:
+    friend struct change_hooks;
+
+    struct savepoint {
+        std::string _name;
+        size_t _pending_before;     // _pending.size() when the savepoint was made
+        bool _began_transaction;
+    };
+
+    // Whether sql_text would commit the transaction that is open.
+    //
+    bool commits(const char *sql_text) const;
+
+    void follow_transaction_control(const char *sql_text);
+
+    void take_changeset();
+
+    void restart_session();
+
+    sqlite3 * const _conn;
+    change_feed &_feed;
+    const bool _with_changesets;
+    sqlite3_session *_session;
+    std::vector<row_change> _pending;       // the open transaction's changes so far
+    std::vector<savepoint> _savepoints;     // innermost at the back
+    std::string _changeset;                 // taken just before the statement that commits
+    committed_changes _committed;           // filled by the commit hook, published after the commit
+    size_t _pending_at_statement_start;
+    bool _was_autocommit;                   // before the current statement
+    bool _wrapped;                          // the current statement is in a savepoint of ours
+    bool _session_stale;                    // the session has seen a commit or rollback
+};
+
+
+// Applies changeset, which came from committed_changes::_changeset, to conn's main database.
+// Throws quince::dbms_exception if it fails, or if on_conflict is abort and there is a conflict.
+//
+void apply_changeset(sqlite3 *conn, const std::string &changeset, changeset_conflict on_conflict);
+
+}
+
+#endif
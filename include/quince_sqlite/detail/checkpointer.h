@@ -0,0 +1,63 @@
+#ifndef QUINCE_SQLITE__detail__checkpointer_h
+#define QUINCE_SQLITE__detail__checkpointer_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+#include <quince_sqlite/settings.h>
+#include <quince_sqlite/detail/connection.h>
+
+
+namespace quince_sqlite {
+
+// Runs a checkpoint_schedule on a thread and a connection of its own, from construction
+// until destruction.
+//
+class checkpointer : private boost::noncopyable {
+public:
+    explicit checkpointer(const connection_spec &);
+
+    ~checkpointer();
+
+    // Sessions call this whenever they start a statement, so that we know when it's quiet.
+    //
+    void note_activity()    { _latest_activity = clock::now().time_since_epoch().count(); }
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    void run();
+
+    void poll();
+
+    // Runs a checkpoint in the given SQLITE_CHECKPOINT_ mode, and returns the size of the
+    // WAL's contents in bytes, as the checkpoint found it.
+    //
+    int64_t checkpoint(int mode);
+
+    const checkpoint_schedule _schedule;
+    connection _connection;
+    const std::string _wal_filename;
+    std::atomic<clock::rep> _latest_activity;
+    int64_t _checkpointed_data_version;     // PRAGMA data_version as of the latest checkpoint
+    bool _backlog;                          // the latest checkpoint didn't catch up
+    bool _stopping;
+    std::mutex _mutex;
+    std::condition_variable _stop_requested;
+    std::thread _thread;
+};
+
+}
+
+#endif
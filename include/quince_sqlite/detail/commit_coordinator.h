@@ -0,0 +1,73 @@
+#ifndef QUINCE_SQLITE__detail__commit_coordinator_h
+#define QUINCE_SQLITE__detail__commit_coordinator_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <quince_sqlite/settings.h>
+#include <quince_sqlite/detail/histogram.h>
+
+
+namespace quince_sqlite {
+
+class database;
+
+struct group_commit_statistics {
+    histogram _units_per_commit;
+    histogram _commit_microseconds;     // from BEGIN to the end of COMMIT
+    uint64_t _failed_units;             // units that threw, and were rolled back on their own
+};
+
+
+// Gathers write units from any number of threads, and runs each gathering in a single
+// transaction, on a thread of its own, with each unit in a savepoint of its own.  So there is
+// one commit, and one fsync, per gathering instead of per unit, and a unit that throws is
+// rolled back without disturbing the others.  Each unit's future becomes ready once the
+// transaction has committed (or failed to).
+//
+class commit_coordinator : private boost::noncopyable {
+public:
+    commit_coordinator(const database &, const group_commit_policy &);
+
+    ~commit_coordinator();
+
+    std::future<void> submit(std::function<void()> &&unit);
+
+    group_commit_statistics get_statistics() const;
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct pending_unit {
+        std::function<void()> _unit;
+        std::promise<void> _promise;
+    };
+
+    void run();
+
+    void commit(std::vector<pending_unit> &);
+
+    const database &_database;
+    const group_commit_policy _policy;
+    std::vector<pending_unit> _pending;
+    clock::time_point _first_pending_at;
+    bool _stopping;
+    group_commit_statistics _statistics;
+    mutable std::mutex _mutex;
+    std::condition_variable _changed;
+    std::thread _thread;
+};
+
+}
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef QUINCE_SQLITE__detail__connection_h
+#define QUINCE_SQLITE__detail__connection_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+#include <quince_sqlite/settings.h>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+
+namespace quince_sqlite {
+
+class change_feed;
+class change_recorder;
+
+struct statement_cache_statistics {
+    uint64_t _hits;         // statements served from the cache
+    uint64_t _misses;       // statements that had to be prepared
+    uint64_t _evictions;    // idle statements finalized to stay within capacity, or on schema change
+
+    statement_cache_statistics &operator+=(const statement_cache_statistics &);
+};
+
+
+struct busy_statistics {
+    uint64_t _waits;                    // times a connection found the database locked and waited
+    double _total_blocked_seconds;      // total time spent waiting
+};
+
+// Shared by all of a database's connections, to accumulate busy_statistics.
+//
+struct busy_counters {
+    std::atomic<uint64_t> _waits;
+    std::atomic<uint64_t> _blocked_microseconds;
+
+    busy_statistics get_statistics() const;
+};
+
+// Everything needed to open a connection.
+//
+struct connection_spec {
+    std::string _filename;
+    int _flags;
+    boost::optional<std::string> _vfs_module_name;
+    settings _settings;
+    busy_counters *_busy_counters;
+    change_feed *_change_feed;          // null unless settings::_change_capture is on
+};
+
+
+// Idle prepared statements, keyed by SQL text, with the least recently used at the front.
+// A statement is taken out of the cache while it is in use, so two live statements never
+// share an sqlite3_stmt.
+//
+class statement_cache : private boost::noncopyable {
+public:
+    statement_cache(sqlite3 *conn, size_t capacity);
+
+    ~statement_cache();
+
+    // An sqlite3_stmt together with the column names of its result rows, which are resolved
+    // once and then shared by every row that the statement produces, however many times it
+    // is reused.
+    //
+    struct prepared {
+        sqlite3_stmt *_stmt;
+        std::vector<std::string> _column_names;
+        int _reprepare_count;   // SQLITE_STMTSTATUS_REPREPARE when _column_names was filled, or -1
+    };
+
+    // Sets was_cached to say whether the statement came from the cache, or had to be prepared.
+    //
+    prepared acquire(const std::string &sql_text, int &result_code, bool &was_cached);
+
+    void release(const std::string &sql_text, prepared &&);
+
+    void evict_all();
+
+    statement_cache_statistics get_statistics() const;
+
+private:
+    typedef std::list<std::pair<std::string, prepared>> lru_list;
+
+    sqlite3_stmt *prepare(const std::string &sql_text, int &result_code) const;
+
+    void evict(lru_list::iterator);
+
+    sqlite3 * const _conn;
+    const size_t _capacity;
+    lru_list _lru;
+    std::unordered_map<std::string, lru_list::iterator> _index;
+
+    // Atomic only so that another thread may read them while a pooled connection is in use.
+    //
+    std::atomic<uint64_t> _hits;
+    std::atomic<uint64_t> _misses;
+    std::atomic<uint64_t> _evictions;
+};
+
+
+// Whether the SQLite library we are running against (not the one we were compiled against)
+// is at least the given version, in the form of SQLITE_VERSION_NUMBER, e.g. 3015000.
+//
+bool sqlite_version_at_least(int version_number);
+
+
+// The PRAGMA statements that put tuning into effect, in an order that works.  If schema is
+// given, the statements apply to that attached database only.  If read_only is true, the
+// settings that would modify the database file are left out.
+//
+std::vector<std::string> tuning_pragmas(
+    const connection_tuning &tuning,
+    bool read_only,
+    const boost::optional<std::string> &schema = boost::none
+);
+
+
+// A database that a statement needs attached, under _name.
+//
+struct attachment {
+    std::string _name;
+    std::string _filename;
+    connection_tuning _tuning;
+};
+
+
+// An open sqlite3 handle, together with the statements prepared on it.
+//
+class connection : private boost::noncopyable {
+public:
+    // Throws quince::failed_connection_exception if sqlite3_open_v2() fails, or
+    // quince::dbms_exception if the settings' tuning can't be applied.
+    //
+    explicit connection(const connection_spec &);
+
+    ~connection();
+
+    sqlite3 *handle() const                 { return _handle; }
+    bool is_read_only() const               { return _read_only; }
+    statement_cache &statements()           { return _statements; }
+    const statement_cache &statements() const   { return _statements; }
+
+    // Runs sql_text, which must not produce output, and throws quince::dbms_exception if it fails.
+    //
+    void exec(const std::string &sql_text);
+
+    // Like sqlite3_step(), but if the busy policy says so, waits out SQLITE_LOCKED in a
+    // shared cache.  rows_so_far is how many rows stmt has already produced.
+    //
+    // If changes are being captured, this (or exec()) is the only way a statement that can
+    // change data or end a transaction may be run: see change_recorder.
+    //
+    int step(sqlite3_stmt *stmt, uint64_t rows_so_far);
+
+    // Makes sure that every one of needed is attached, and applies its tuning when it is
+    // first attached.  If that would take us past SQLite's limit on attached databases,
+    // the least recently needed others are detached first, as far as SQLite allows (it won't
+    // detach during a transaction).  Throws quince::dbms_exception if an ATTACH fails.
+    //
+    void attach(const std::vector<attachment> &needed);
+
+private:
+    void attach_or_detach(const std::string &filename, const std::string &name);
+
+    // The busy handler's state, which must have a fixed address before _handle is opened.
+    //
+    struct busy_waiter {
+        const busy_policy _policy;
+        busy_counters * const _counters;
+        std::chrono::steady_clock::time_point _started;
+
+        static int handle_busy(void *waiter, int prior_calls);
+    };
+
+    busy_waiter _busy_waiter;
+    sqlite3 * const _handle;
+    const bool _read_only;
+    statement_cache _statements;
+    std::list<std::string> _attached;    // names, least recently needed at the front
+    std::unique_ptr<change_recorder> _changes;
+};
+
+}
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef QUINCE_SQLITE__detail__connection_pool_h
+#define QUINCE_SQLITE__detail__connection_pool_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+#include <quince_sqlite/settings.h>
+#include <quince_sqlite/detail/connection.h>
+
+
+namespace quince_sqlite {
+
+struct connection_pool_statistics {
+    size_t _readers;                // read-only connections in the pool
+    size_t _writers;                // read-write connections in the pool (always 1)
+    uint64_t _checkouts;            // connections handed out, readers and writers together
+    uint64_t _waits;                // checkouts that found no idle connection and had to wait
+    double _total_wait_seconds;     // time spent in those waits
+    double _reader_utilisation;     // fraction of reader-time spent checked out, since the pool was filled
+    double _writer_utilisation;     // likewise for the writer
+};
+
+
+// A fixed set of connections, all opened (and warmed up) when the pool is constructed: one
+// writer, plus a number of SQLITE_OPEN_READONLY readers that can run alongside the writer
+// in WAL mode.  A checked-out connection is returned to the pool when the last copy of its
+// shared_ptr goes away, so every checkout must be released before the pool is destroyed.
+//
+class connection_pool : private boost::noncopyable {
+public:
+    // Throws quince::unsupported_exception if the spec's filename would give each connection
+    // a private in-memory database, e.g. ":memory:".
+    //
+    explicit connection_pool(const connection_spec &);
+
+    ~connection_pool();
+
+    // Each of these blocks until a connection of the requested kind is idle.  Waiting for the
+    // writer is like waiting for a lock on the database: it gives up after the busy policy's
+    // timeout, and throws quince::deadlock_exception, since the writer may be held by a
+    // transaction on this very thread, which is waiting for another to write.
+    //
+    std::shared_ptr<connection> acquire_reader();
+    std::shared_ptr<connection> acquire_writer();
+
+    connection_pool_statistics get_statistics() const;
+
+    // Totals over all the connections in the pool.
+    //
+    statement_cache_statistics get_statement_cache_statistics() const;
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct member {
+        std::unique_ptr<connection> _connection;
+        clock::time_point _checked_out_at;
+    };
+
+    struct tier {
+        size_t _size;
+        std::vector<std::unique_ptr<member>> _idle;
+        std::condition_variable _became_idle;
+        double _busy_seconds;
+    };
+
+    std::shared_ptr<connection> acquire(tier &);
+
+    void give_back(tier &, member *);
+
+    const std::chrono::milliseconds _writer_wait_timeout;
+    const clock::time_point _filled_at;
+    tier _readers;
+    tier _writers;
+    std::vector<const connection *> _all;
+    uint64_t _checkouts;
+    uint64_t _waits;
+    clock::duration _total_wait;
+    mutable std::mutex _mutex;
+};
+
+}
+
+#endif
@@ -7,6 +7,7 @@
 //          http://www.boost.org/LICENSE_1_0.txt)
 
 #include <quince/detail/sql.h>
+#include <quince/exprn_mappers/detail/exprn_mapper.h>
 
 
 namespace quince_sqlite {
@@ -57,8 +58,45 @@ public:
 
     void write_retrieve_metadata(const quince::binomen &table);
 
+    void write_retrieve_schema_version(const boost::optional<std::string> &enclosure);
+
+    void write_retrieve_all_metadata(const boost::optional<std::string> &enclosure);
+
+    void write_convert_text_column(const quince::binomen &table, const std::string &column, const std::string &function);
+
+    void write_preallocate_blob(const quince::binomen &table, const std::string &column);
+
+    void write_create_partial_index(
+        const quince::binomen &table,
+        const std::string &index_name,
+        const std::vector<const quince::abstract_mapper_base *> &,
+        const quince::abstract_predicate &predicate,
+        bool unique
+    );
+
+    // The parenthesized list of columns and expressions that an index is keyed on.  Throws
+    // quince::unsupported_exception if an expression needs a bound parameter.
+    //
+    void write_index_key(const std::vector<const quince::abstract_mapper_base *> &);
+
+    // get_text(), except that the SELECTs that have DISTINCT ON (as written by write_distinct())
+    // are rewritten into SQL that SQLite understands.  If there are none, this is just a copy
+    // of get_text().
+    //
+    std::string expanded_text() const;
+
 private:
+    // Where write_distinct() wrote the marker for a DISTINCT ON, as offsets in get_text().
+    //
+    struct distinct_on {
+        size_t _marker;
+        size_t _partition_begin;    // the distinct expressions, inside the marker
+        size_t _partition_end;
+        size_t _list_begin;         // the select list, just after the marker
+    };
+
     uint32_t _next_placeholder_serial;
+    std::vector<distinct_on> _distinct_ons;
 };
 
 }
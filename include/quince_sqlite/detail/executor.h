@@ -0,0 +1,75 @@
+#ifndef QUINCE_SQLITE__detail__executor_h
+#define QUINCE_SQLITE__detail__executor_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <boost/noncopyable.hpp>
+
+
+namespace quince_sqlite {
+
+// A queue of jobs that any number of threads may push, without locking, and one thread pops.
+// (It is Dmitry Vyukov's intrusive MPSC queue.)  A pop may miss a push that is still in
+// progress, but never one that has returned.
+//
+class job_queue : private boost::noncopyable {
+public:
+    job_queue();
+
+    ~job_queue();
+
+    void push(std::function<void()> &&job);
+
+    // Consumer only.
+    //
+    bool try_pop(std::function<void()> &job);
+    bool empty() const;
+
+private:
+    struct node {
+        std::atomic<node *> _next;
+        std::function<void()> _job;
+    };
+
+    std::atomic<node *> _head;  // the most recently pushed node
+    node *_tail;                // a node whose job has been taken; the next one is the oldest job
+};
+
+
+// A thread that runs jobs in the order they are posted, back to back, from construction until
+// destruction.  The destructor lets the jobs that were already posted finish first.
+//
+// Since quince gives each thread its own session, every job on an executor uses the same
+// session, and hence the same connection (or, with a connection pool, the same leases).
+//
+class executor : private boost::noncopyable {
+public:
+    executor();
+
+    ~executor();
+
+    void post(std::function<void()> &&job);
+
+private:
+    void run();
+
+    job_queue _jobs;
+    std::atomic<bool> _sleeping;
+    bool _woken;
+    bool _stopping;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::thread _thread;
+};
+
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef QUINCE_SQLITE__detail__histogram_h
+#define QUINCE_SQLITE__detail__histogram_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stdint.h>
+#include <array>
+#include <ostream>
+
+
+namespace quince_sqlite {
+
+// A histogram of non-negative integer samples (typically microseconds), with power-of-two
+// buckets: bucket 0 counts samples of 0, and bucket i counts samples in [2^(i-1), 2^i).
+// Not thread-safe.
+//
+class histogram {
+public:
+    static const size_t bucket_count = 40;
+
+    histogram();
+
+    void record(uint64_t sample);
+
+    histogram &operator+=(const histogram &);
+
+    uint64_t count() const                                      { return _count; }
+    uint64_t total() const                                      { return _total; }
+    uint64_t max() const                                        { return _max; }
+    const std::array<uint64_t, bucket_count> &buckets() const   { return _buckets; }
+
+    // An upper bound for the given fraction (between 0 and 1) of the samples, accurate to
+    // within a factor of 2.
+    //
+    uint64_t percentile(double fraction) const;
+
+    // Writes a JSON object with count, total, max, p50, p90, p99, and the non-empty buckets,
+    // keyed by their upper bounds.
+    //
+    void write_json(std::ostream &) const;
+
+private:
+    std::array<uint64_t, bucket_count> _buckets;
+    uint64_t _count;
+    uint64_t _total;
+    uint64_t _max;
+};
+
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef QUINCE_SQLITE__detail__image_h
+#define QUINCE_SQLITE__detail__image_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <memory>
+#include <string>
+#include <quince_sqlite/detail/connection.h>
+
+struct sqlite3;
+
+
+namespace quince_sqlite {
+
+// A URI for a new, process-wide in-memory database, which every connection that opens it
+// (with SQLITE_OPEN_URI) will share.  See https://sqlite.org/src/file/src/memdb.c
+//
+std::string new_memdb_uri();
+
+// Reads the database image in image_filename into memory, and installs it as the shared
+// in-memory database at memdb_uri.  The image stays there for as long as the returned
+// connection is open.  (It is up to other connections to open it read-only.)
+//
+std::unique_ptr<connection> load_image(const std::string &image_filename, const std::string &memdb_uri);
+
+// Writes schema of conn to image_filename, in a form that load_image() can read (which is
+// simply the form of a database file).
+//
+void save_image(sqlite3 *conn, const std::string &schema, const std::string &image_filename);
+
+}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef QUINCE_SQLITE__detail__instrumented_vfs_h
+#define QUINCE_SQLITE__detail__instrumented_vfs_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <boost/optional.hpp>
+#include <quince_sqlite/detail/histogram.h>
+
+
+namespace quince_sqlite {
+
+enum class file_kind { main_db, main_journal, wal, temp_db, temp_journal, subjournal, super_journal, other };
+
+struct file_io_statistics {
+    file_kind _kind;
+    uint64_t _opens;
+    uint64_t _reads;
+    uint64_t _writes;
+    uint64_t _syncs;
+    uint64_t _bytes_read;           // as requested by SQLite, whether or not from the read-ahead buffer
+    uint64_t _bytes_written;
+    uint64_t _read_ahead_hits;      // reads served from the read-ahead buffer
+    histogram _read_microseconds;   // reads that went to the underlying VFS, including read-ahead fills
+    histogram _write_microseconds;
+    histogram _sync_microseconds;
+};
+
+
+// Registers (once per combination of arguments) a VFS that passes everything through to the
+// VFS called underlying_vfs_name (or the default VFS), counting and timing reads, writes and
+// syncs.  Returns the name to open connections with.
+//
+// If read_ahead_bytes is non-zero, then whenever a main database file is read sequentially,
+// the next read_ahead_bytes are fetched in one go, and later reads are served from that
+// buffer.  The buffer is dropped whenever the file is written or truncated, whenever the
+// connection's lock on it changes, and, in WAL mode, whenever the connection takes a lock in
+// shared memory (as it does to begin each transaction), so it never outlives the transaction
+// that filled it.
+//
+std::string register_instrumented_vfs(const boost::optional<std::string> &underlying_vfs_name, size_t read_ahead_bytes);
+
+// Statistics for every file opened through an instrumented VFS, keyed by filename.  Files
+// that have no name (e.g. temporary files) are counted together, under "(" + kind + ")".
+// The statistics are process-wide, and they survive the closing of the file.
+//
+std::map<std::string, file_io_statistics> get_instrumented_vfs_statistics();
+
+void reset_instrumented_vfs_statistics();
+
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef QUINCE_SQLITE__detail__query_plan_advisor_h
+#define QUINCE_SQLITE__detail__query_plan_advisor_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+struct sqlite3;
+
+
+namespace quince_sqlite {
+
+// Something in a query plan that suggests a missing index.
+//
+struct query_plan_finding {
+    enum class kind {
+        full_scan,          // the table is read from end to end
+        temp_b_tree,        // rows are sorted or deduplicated in a temporary B-tree
+        automatic_index     // SQLite builds a throwaway index for every execution
+    };
+
+    kind _kind;
+    std::string _sql;                   // the statement whose plan this is
+    std::string _detail;                // the line of EXPLAIN QUERY PLAN output
+    std::string _table;                 // the table concerned, if the plan names it
+    std::vector<std::string> _columns;  // the columns an index should cover, from the plan or the SQL
+    std::string _suggestion;            // a quince index_spec to try, if there are columns
+};
+
+
+// Runs EXPLAIN QUERY PLAN once for each distinct SQL text that it is shown (if it's a query
+// or a data-changing statement), and keeps a record of anything that looks like a missing
+// index.  It remembers the most recent few thousand SQL texts it has examined, so ad hoc SQL
+// can't make it grow without bound, though a text it has forgotten may be reported again.
+// Thread-safe.
+//
+class query_plan_advisor : private boost::noncopyable {
+public:
+    void examine(sqlite3 *conn, const std::string &sql_text);
+
+    std::vector<query_plan_finding> get_findings() const;
+
+    // Forgets the findings, and which statements have been examined.
+    //
+    void clear();
+
+    // Analyses one line of EXPLAIN QUERY PLAN output.  Returns false if there's nothing
+    // to report.
+    //
+    static bool analyse(const std::string &detail, query_plan_finding &result);
+
+private:
+    // Fills in the columns of a full scan or a sort from the finding's SQL, and the suggestion.
+    //
+    static void add_candidate_columns(query_plan_finding &);
+
+    mutable std::mutex _mutex;
+    std::list<std::string> _examined;       // least recently shown at the front
+    std::unordered_map<std::string, std::list<std::string>::iterator> _examined_index;
+    std::vector<query_plan_finding> _findings;
+};
+
+}
+
+#endif
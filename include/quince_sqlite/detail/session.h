@@ -6,49 +6,90 @@
 //    (See accompanying file ../../../LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 
+#include <functional>
+#include <memory>
+#include <stdint.h>
 #include <string>
 #include <vector>
 #include <boost/noncopyable.hpp>
 #include <boost/optional.hpp>
 #include <quince/detail/compiler_specific.h>
 #include <quince/detail/session.h>
-
-struct sqlite3;
+#include <quince_sqlite/settings.h>
+#include <quince_sqlite/detail/connection.h>
 
 
 namespace quince_sqlite {
 
 class database;
+class connection_pool;
 
 class session_impl : public quince::abstract_session_impl {
 public:
-    struct spec {
-        std::string _filename;
-        int _flags;
-        boost::optional<std::string> _vfs_module_name;
-    };
+    typedef connection_spec spec;
 
-    explicit session_impl(const database &, const session_impl::spec &);
+    // If pool is null, the session opens a connection of its own.  Otherwise it borrows
+    // connections from the pool as it needs them.
+    //
+    session_impl(const database &, const session_impl::spec &, connection_pool *pool = nullptr);
 
     virtual ~session_impl();
 
     virtual bool                            unchecked_exec(const quince::sql &) override;
     virtual void                            exec(const quince::sql &) override;
-    virtual quince::result_stream           exec_with_stream_output(const quince::sql &, uint32_t ignored) override;
     virtual std::unique_ptr<quince::row>    exec_with_one_output(const quince::sql &) override;
     virtual std::unique_ptr<quince::row>    next_output(const quince::result_stream &) override;
 
+    // The stream steps up to fetch_size rows ahead of next_output(), so each row is as the
+    // database was when it was fetched, not when it is handed out.  In particular, writes that
+    // this session makes while the stream is open don't show up in rows that were already
+    // fetched.  (Without a pool, SQLite doesn't promise that a statement sees later changes on
+    // its own connection anyway.  With a pool, the stream reads a snapshot, and sees none.)  So
+    // a caller that interleaves reading with writing, and wants the rows to reflect its writes
+    // wherever SQLite allows, should ask for a fetch_size of 1.
+    //
+    virtual quince::result_stream           exec_with_stream_output(const quince::sql &, uint32_t fetch_size) override;
+
     quince::serial last_inserted_serial() const;
 
+    statement_cache_statistics get_statement_cache_statistics() const;
+
+    // Runs fn on the connection that this session's writes go to, inside a savepoint that is
+    // released if fn returns normally, or rolled back if it throws.  This is for maintenance
+    // jobs that need SQLite's own API rather than quince's.  Their statements should still be
+    // run with connection::step(), so that changes are captured.
+    //
+    void with_writer(const std::function<void(connection &)> &fn);
+
+    // The connection that this session would use for a read (or, if writable, a write), for
+    // work that goes straight to SQLite's API, such as blob handles.  With a pool, the returned
+    // lease keeps the connection checked out until it is released.
+    //
+    std::shared_ptr<connection> checkout(bool writable);
+
 private:
     QUINCE_NORETURN void throw_last_error(int last_result_code) const;
 
     class statement;
 
-    std::unique_ptr<statement> make_stmt(const quince::sql &cmd);
+    // cmd_outlives_stmt must be false unless cmd will still exist when the statement is destroyed.
+    //
+    std::unique_ptr<statement> make_stmt(const quince::sql &cmd, bool cmd_outlives_stmt = true);
+
+    std::shared_ptr<connection> connection_for(const std::string &sql_text);
+
+    std::shared_ptr<connection> acquire_writer();
+
+    void after_step(const statement &);
 
     const database &_database;
-    sqlite3 * const _conn;
+    connection_pool * const _pool;
+    const std::shared_ptr<connection> _dedicated;   // null iff _pool is not
+    std::shared_ptr<connection> _writer;            // the pool's writer, while we have a transaction open on it
+    std::weak_ptr<connection> _writer_lease;        // the pool's writer, while anything of ours holds it
+    std::weak_ptr<connection> _reader;              // the pool's reader that our open result streams are using
+    bool _reader_is_stale;                          // we have written since _reader's streams began
+    int64_t _last_insert_rowid;
     std::string _latest_sql;
 };
 
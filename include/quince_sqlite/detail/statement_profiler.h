@@ -0,0 +1,79 @@
+#ifndef QUINCE_SQLITE__detail__statement_profiler_h
+#define QUINCE_SQLITE__detail__statement_profiler_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <boost/noncopyable.hpp>
+#include <quince_sqlite/detail/histogram.h>
+
+
+namespace quince_sqlite {
+
+// What we know about one execution of a statement.
+//
+struct statement_sample {
+    bool _prepared;                     // true if it was prepared afresh, false if it came from the cache
+    uint64_t _prepare_microseconds;     // time to prepare it, or to fetch it from the cache
+    uint64_t _step_microseconds;        // total time in sqlite3_step()
+    uint64_t _rows;
+    uint64_t _fullscan_steps;           // the rest are from sqlite3_stmt_status()
+    uint64_t _sorts;
+    uint64_t _autoindexes;
+    uint64_t _vm_steps;
+};
+
+// Totals over all executions of statements with the same normalised text.
+//
+struct statement_profile {
+    uint64_t _calls;
+    uint64_t _prepares;
+    uint64_t _prepare_microseconds;
+    histogram _step_microseconds;       // one sample per call
+    uint64_t _rows;
+    uint64_t _fullscan_steps;
+    uint64_t _sorts;
+    uint64_t _autoindexes;
+    uint64_t _vm_steps;
+};
+
+
+// Collects statement_samples from all of a database's sessions.  Thread-safe.
+//
+class statement_profiler : private boost::noncopyable {
+public:
+    void record(const std::string &sql_text, const statement_sample &);
+
+    // Keyed by normalised SQL text.
+    //
+    std::map<std::string, statement_profile> get_profiles() const;
+
+    // Writes an array of objects, one per normalised SQL text, heaviest total step time first.
+    //
+    void write_json(std::ostream &) const;
+
+    void clear();
+
+    // sql_text with its literal numbers and strings replaced by "?", and runs of whitespace
+    // collapsed, so that statements that differ only in literals share a profile.  (Quince
+    // passes most values as parameters anyway, but not all: LIMIT values are one exception.)
+    //
+    static std::string normalize(const std::string &sql_text);
+
+private:
+    mutable std::mutex _mutex;
+    std::unordered_map<std::string, statement_profile> _profiles;
+    std::unordered_map<std::string, std::string> _normalized;   // memo for normalize()
+};
+
+}
+
+#endif
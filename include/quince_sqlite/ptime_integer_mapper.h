@@ -0,0 +1,54 @@
+#ifndef QUINCE_SQLITE__ptime_integer_mapper_h
+#define QUINCE_SQLITE__ptime_integer_mapper_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stdint.h>
+#include <boost/date_time/posix_time/ptime.hpp>
+#include <quince/detail/compiler_specific.h>
+#include <quince/mappers/direct_mapper.h>
+
+
+QUINCE_SUPPRESS_MSVC_DOMINANCE_WARNING
+
+namespace quince_sqlite {
+
+// Maps boost::posix_time::ptime to an INTEGER column that holds microseconds since
+// 1970-01-01 00:00:00, instead of the TEXT form that quince_sqlite uses by default.
+// Integer order is time order, so range predicates and indexes work as expected.
+// The special values are kept as the extremes of the range: not_a_date_time is
+// INT64_MIN, neg_infin is INT64_MIN+1, and pos_infin is INT64_MAX.
+//
+// To use it for every ptime in a database, set settings::_ptime_storage to
+// ptime_storage::integer; or to use it more selectively, name it in a
+// quince::mapping_customization.
+//
+class ptime_integer_mapper :
+    public quince::abstract_mapper<boost::posix_time::ptime>,
+    public quince::direct_mapper<int64_t>
+{
+public:
+    explicit ptime_integer_mapper(const boost::optional<std::string> &name, const quince::mapper_factory &creator);
+
+    virtual std::unique_ptr<quince::cloneable> clone_impl() const override;
+
+    virtual void from_row(const quince::row &src, boost::posix_time::ptime &dest) const override;
+
+    virtual void to_row(const boost::posix_time::ptime &src, quince::row &dest) const override;
+
+    static int64_t to_microseconds(const boost::posix_time::ptime &);
+
+    static boost::posix_time::ptime from_microseconds(int64_t);
+
+protected:
+    virtual void build_match_tester(const quince::query_base &qb, quince::predicate &result) const override;
+};
+
+}
+
+QUINCE_UNSUPPRESS_MSVC_WARNING
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef QUINCE_SQLITE__settings_h
+#define QUINCE_SQLITE__settings_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <map>
+#include <string>
+#include <boost/optional.hpp>
+
+
+namespace quince_sqlite {
+
+enum class journal_mode { delete_, truncate, persist, memory, wal, off };
+enum class synchronous { off, normal, full, extra };
+enum class temp_store { default_, file, memory };
+enum class ptime_storage { text, integer };
+enum class change_capture { off, feed, feed_and_changesets };
+
+// PRAGMA settings that are applied to every connection as soon as it is opened.  Each one
+// is left as SQLite's default unless it is given a value.  See https://sqlite.org/pragma.html
+// for what they mean.
+//
+struct connection_tuning {
+    boost::optional<int64_t> _page_size;            // only has effect before the database is populated
+    boost::optional<journal_mode> _journal_mode;
+    boost::optional<synchronous> _synchronous;
+    boost::optional<int64_t> _cache_size;           // pages if positive, KiB if negative
+    boost::optional<int64_t> _mmap_size;            // bytes
+    boost::optional<temp_store> _temp_store;
+    boost::optional<int64_t> _wal_autocheckpoint;   // pages; 0 turns it off
+};
+
+// A background task that checkpoints the WAL on a dedicated connection, instead of leaving
+// it to whichever write happens to cross the autocheckpoint threshold.  While it is enabled,
+// the autocheckpoint is turned off on every other connection, whatever connection_tuning says.
+//
+// Every _poll_interval it looks at the size of the WAL file.  Once that exceeds
+// _passive_threshold_bytes, and there have been commits since the last checkpoint caught up,
+// it runs a PASSIVE checkpoint, which never waits for readers or writers.  If that catches up
+// with a WAL larger than _truncate_threshold_bytes, it follows with a RESTART checkpoint, so
+// that writers reuse the file from the start.  Once the file exceeds _truncate_threshold_bytes
+// and no statement has started for at least _idle_time, it runs a TRUNCATE checkpoint, which
+// resets the WAL file to zero bytes.
+//
+struct checkpoint_schedule {
+    bool _enabled = false;
+    std::chrono::milliseconds _poll_interval = std::chrono::milliseconds(1000);
+    int64_t _passive_threshold_bytes = 4 << 20;
+    int64_t _truncate_threshold_bytes = 64 << 20;
+    std::chrono::milliseconds _idle_time = std::chrono::milliseconds(500);
+};
+
+// What a connection does when it finds the database locked by another connection.  It
+// sleeps and retries, with exponential backoff from _initial_backoff up to _max_backoff,
+// until it succeeds or _timeout has passed, and then quince::deadlock_exception is thrown.
+// Each sleep is shortened by a random fraction, up to _jitter, so that connections that
+// collide once don't keep colliding in lockstep.  The default _timeout of 0 gives up at once.
+//
+// _unlock_notify applies to SQLITE_LOCKED in shared-cache mode, where another connection
+// in the same cache holds a table lock: instead of failing, the statement blocks until
+// sqlite3_unlock_notify() says the lock is gone, and then restarts, provided it hasn't
+// produced any rows yet.
+//
+struct busy_policy {
+    std::chrono::milliseconds _timeout = std::chrono::milliseconds(0);
+    std::chrono::microseconds _initial_backoff = std::chrono::microseconds(1000);
+    std::chrono::microseconds _max_backoff = std::chrono::microseconds(50000);
+    double _jitter = 0.5;
+    bool _unlock_notify = false;
+};
+
+// Lets database::submit_write() gather small write transactions from many threads into one
+// commit: see commit_coordinator.h.  A gathering is committed when it has _max_units units,
+// or when _window has passed since its first unit was submitted.
+//
+struct group_commit_policy {
+    bool _enabled = false;
+    std::chrono::microseconds _window = std::chrono::microseconds(2000);
+    size_t _max_units = 128;
+};
+
+// Options for a quince_sqlite::database, beyond the ones that the constructor takes
+// individually.  Every member has a sensible default, so callers only assign the ones
+// they care about, e.g.:
+//
+//      quince_sqlite::settings s;
+//      s._statement_cache_capacity = 256;
+//      const quince_sqlite::database db("my.db", true, true, true, boost::none, boost::none, {}, s);
+//
+struct settings {
+    // Maximum number of idle prepared statements that each connection keeps for reuse.
+    // 0 disables the cache, so that every statement is prepared afresh.
+    //
+    size_t _statement_cache_capacity = 64;
+
+    // If non-zero, the database opens all its connections up front, in WAL mode: one writer
+    // plus this many read-only connections.  Sessions then borrow connections from the pool
+    // instead of opening their own: a reader for each query made outside a transaction, and
+    // the writer for everything else, held until the transaction ends.  Pooled connections
+    // always use a private cache, whatever the constructor's share_cache argument says, so
+    // the database can't be an in-memory one.  A session that finds the writer taken waits for
+    // it no longer than _busy._timeout.
+    //
+    size_t _pooled_readers = 0;
+
+    connection_tuning _tuning;
+
+    checkpoint_schedule _checkpoints;
+
+    busy_policy _busy;
+
+    // How boost::posix_time::ptime values are stored, unless a mapping_customization says
+    // otherwise.  text is the traditional form, e.g. "2014-Jan-01 10:00:00".  integer is
+    // microseconds since the epoch: see ptime_integer_mapper.h.
+    //
+    ptime_storage _ptime_storage = ptime_storage::text;
+
+    // If true, every statement execution is timed and counted, per normalised SQL text.
+    // See database::get_statement_profiles().
+    //
+    bool _profile_statements = false;
+
+    // If true, the first time each distinct SQL text is executed, its EXPLAIN QUERY PLAN is
+    // checked for full table scans, temporary B-trees and automatic indexes.  This is a
+    // diagnostic mode, e.g. for a test suite: see database::get_query_plan_findings().
+    //
+    bool _advise_query_plans = false;
+
+    // Number of executor threads that database::submit() hands jobs to.  Each has its own
+    // session, and so its own connection.  0 means that submitted jobs run on the caller's
+    // thread, before submit() returns.
+    //
+    size_t _executor_threads = 0;
+
+    group_commit_policy _group_commit;
+
+    // If true, the constructor's filename names a database image (see database::write_image()),
+    // which is read into memory once, and then shared, read-only, by every session.  So there
+    // is no file I/O after construction.  may_write, share_cache and vfs_module_name are
+    // ignored.
+    //
+    bool _load_image = false;
+
+    // If true, connections open their files through a shim VFS that counts and times every
+    // read, write and sync, on top of the VFS named by the constructor's vfs_module_name (or
+    // the default).  See database::get_io_statistics().  If _read_ahead_bytes is also non-zero,
+    // sequential reads of the main database file fetch that many bytes at a time.  See
+    // instrumented_vfs.h.
+    //
+    bool _instrument_io = false;
+    size_t _read_ahead_bytes = 0;
+
+    // Tuning for attached databases (i.e. enclosures), by enclosure name.  An enclosure that
+    // isn't listed gets _tuning.  Each connection applies it when it attaches the enclosure.
+    //
+    std::map<std::string, connection_tuning> _enclosure_tuning;
+
+    // If not off, each read-write connection records the rows that its transactions insert,
+    // update and remove, and once a transaction has committed, hands them to the subscribers
+    // registered with database::subscribe_to_changes().  feed_and_changesets also records each
+    // transaction's changes to the main database as an SQLite changeset, which a replica can
+    // apply with database::apply_changeset().  Writes through a blob handle aren't recorded.
+    // See change_feed.h.
+    //
+    change_capture _change_capture = change_capture::off;
+};
+
+}
+
+#endif
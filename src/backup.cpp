@@ -0,0 +1,54 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <thread>
+#include <quince/exceptions.h>
+#include <sqlite3.h>
+#include <quince_sqlite/detail/backup.h>
+
+using namespace quince;
+using std::string;
+
+
+namespace quince_sqlite {
+
+// SQLITE_BUSY and SQLITE_LOCKED from a step just mean that someone else has the lock right
+// now, so we wait out the pause and try again.
+//
+bool
+run_backup(sqlite3 *source, const string &schema, sqlite3 *dest, const backup_options &options) {
+    sqlite3_backup * const backup = sqlite3_backup_init(dest, "main", source, schema.c_str());
+    if (backup == nullptr)  throw dbms_exception(sqlite3_errmsg(dest));
+
+    int result_code;
+    bool abandoned = false;
+    while ((result_code = sqlite3_backup_step(backup, options._pages_per_step)) != SQLITE_DONE) {
+        switch (result_code) {
+            case SQLITE_OK:
+            case SQLITE_BUSY:
+            case SQLITE_LOCKED:
+                break;
+            default:
+                sqlite3_backup_finish(backup);
+                throw dbms_exception(string(sqlite3_errstr(result_code)) + " (during backup)");
+        }
+        if (options._on_progress) {
+            const backup_progress progress = { sqlite3_backup_remaining(backup), sqlite3_backup_pagecount(backup) };
+            if (! options._on_progress(progress)) {
+                abandoned = true;
+                break;
+            }
+        }
+        std::this_thread::sleep_for(options._pause);
+    }
+    if (! abandoned  &&  options._on_progress)
+        options._on_progress({ 0, sqlite3_backup_pagecount(backup) });
+
+    if ((result_code = sqlite3_backup_finish(backup)) != SQLITE_OK)
+        throw dbms_exception(string(sqlite3_errstr(result_code)) + " (finishing backup)");
+    return ! abandoned;
+}
+
+}
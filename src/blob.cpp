@@ -0,0 +1,87 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <quince/exceptions.h>
+#include <sqlite3.h>
+#include <quince_sqlite/blob.h>
+#include <quince_sqlite/database.h>
+#include <quince_sqlite/detail/dialect_sql.h>
+
+using namespace quince;
+using std::string;
+using std::unique_ptr;
+
+
+namespace quince_sqlite {
+
+blob::blob(const database &db, const binomen &table, const string &column, int64_t rowid, bool writable) :
+    _connection(db.checkout_connection(table._enclosure, writable)),
+    _handle(nullptr)
+{
+    const string schema = table._enclosure ? *table._enclosure : "main";
+    check(sqlite3_blob_open(
+        _connection->handle(),
+        schema.c_str(),
+        table._local.c_str(),
+        column.c_str(),
+        rowid,
+        writable,
+        &_handle
+    ));
+}
+
+blob::~blob() {
+    sqlite3_blob_close(_handle);
+}
+
+size_t
+blob::size() const {
+    return size_t(sqlite3_blob_bytes(_handle));
+}
+
+void
+blob::read(void *dest, size_t n, size_t offset) const {
+    check(sqlite3_blob_read(_handle, dest, int(n), int(offset)));
+}
+
+void
+blob::write(const void *src, size_t n, size_t offset) {
+    check(sqlite3_blob_write(_handle, src, int(n), int(offset)));
+}
+
+void
+blob::reopen(int64_t rowid) {
+    check(sqlite3_blob_reopen(_handle, rowid));
+}
+
+void
+blob::preallocate(const database &db, const binomen &table, const string &column, int64_t rowid, size_t size) {
+    const unique_ptr<dialect_sql> cmd = db.make_dialect_sql();
+    cmd->write_preallocate_blob(table, column);
+
+    const std::shared_ptr<connection> conn = db.checkout_connection(table._enclosure, true);
+    sqlite3 * const handle = conn->handle();
+    sqlite3_stmt *stmt = nullptr;
+    int result_code = sqlite3_prepare_v2(handle, cmd->get_text().c_str(), -1, &stmt, nullptr);
+    if (result_code == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, sqlite3_int64(size));
+        sqlite3_bind_int64(stmt, 2, rowid);
+        result_code = conn->step(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    if (result_code != SQLITE_DONE)  throw dbms_exception(sqlite3_errmsg(handle));
+    if (sqlite3_changes(handle) == 0)  throw dbms_exception("no record with rowid " + std::to_string(rowid));
+}
+
+// A handle whose sqlite3_blob_reopen() fails is unusable from then on, but it still needs
+// closing, so we keep it.
+//
+void
+blob::check(int result_code) const {
+    if (result_code != SQLITE_OK)
+        throw dbms_exception(sqlite3_errmsg(_connection->handle()));
+}
+
+}
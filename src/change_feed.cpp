@@ -0,0 +1,387 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <assert.h>
+#include <ctype.h>
+#include <string.h>
+#include <algorithm>
+#include <quince/exceptions.h>
+#include <sqlite3.h>
+#include <quince_sqlite/detail/change_feed.h>
+
+using boost::optional;
+using namespace quince;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+
+namespace quince_sqlite {
+
+namespace {
+    const char * const capture_savepoint = "quince_sqlite_capture";
+
+    // The words of a transaction control statement, upper-cased except for quoted names,
+    // which are unquoted.
+    //
+    vector<string>
+    words(const char *sql_text) {
+        vector<string> result;
+        const char *p = sql_text;
+        for (;;) {
+            while (isspace(static_cast<unsigned char>(*p))  ||  *p == ';')  ++p;
+            if (*p == '\0')  break;
+
+            string word;
+            if (strchr("\"'`[", *p)) {
+                const char close = *p == '[' ? ']' : *p;
+                for (++p; *p != '\0'; ++p) {
+                    if (*p == close  &&  p[1] == close  &&  close != ']')  ++p;
+                    else if (*p == close)  { ++p; break; }
+                    word += *p;
+                }
+            }
+            else
+                for (; *p != '\0'  &&  ! isspace(static_cast<unsigned char>(*p))  &&  *p != ';'; ++p)
+                    word += char(toupper(static_cast<unsigned char>(*p)));
+            result.push_back(word);
+        }
+        return result;
+    }
+
+    // Only these need to be taken apart by words().
+    //
+    bool
+    is_transaction_control(const char *sql_text) {
+        while (isspace(static_cast<unsigned char>(*sql_text)))  ++sql_text;
+        for (const char *keyword: { "SAVEPOINT", "RELEASE", "ROLLBACK", "COMMIT", "END" })
+            if (sqlite3_strnicmp(sql_text, keyword, int(strlen(keyword))) == 0)
+                return true;
+        return false;
+    }
+
+    bool
+    same_name(const string &lhs, const string &rhs) {
+        return lhs.size() == rhs.size()
+            && sqlite3_strnicmp(lhs.c_str(), rhs.c_str(), int(lhs.size())) == 0;
+    }
+
+    // The savepoint named by `RELEASE [SAVEPOINT] name' or `ROLLBACK [TRANSACTION] TO
+    // [SAVEPOINT] name', given the words after RELEASE or TO.
+    //
+    optional<string>
+    savepoint_name(const vector<string> &w, size_t first) {
+        if (first < w.size()  &&  w[first] == "SAVEPOINT")  first++;
+        if (first + 1 != w.size())  return boost::none;
+        return w[first];
+    }
+
+    optional<string>
+    rollback_to_name(const vector<string> &w) {
+        if (w.empty()  ||  w[0] != "ROLLBACK")  return boost::none;
+        size_t i = 1;
+        if (i < w.size()  &&  w[i] == "TRANSACTION")  i++;
+        if (i == w.size()  ||  w[i] != "TO")  return boost::none;
+        return savepoint_name(w, i + 1);
+    }
+
+    optional<string>
+    release_name(const vector<string> &w) {
+        if (w.empty()  ||  w[0] != "RELEASE")  return boost::none;
+        return savepoint_name(w, 1);
+    }
+
+    change_operation
+    to_change_operation(int op) {
+        switch (op) {
+            case SQLITE_INSERT: return change_operation::insert;
+            case SQLITE_UPDATE: return change_operation::update;
+            default:            return change_operation::remove;
+        }
+    }
+
+    bool
+    starts_with_keyword(const char *sql_text, const char *keyword) {
+        const size_t length = strlen(keyword);
+        return sqlite3_strnicmp(sql_text, keyword, int(length)) == 0
+            && ! isalnum(static_cast<unsigned char>(sql_text[length]))
+            && sql_text[length] != '_';
+    }
+
+    // Statements that change data, as opposed to schema, transaction state or settings, any of
+    // which might refuse to run inside our savepoint.  One that begins with WITH may be a
+    // SELECT or an INSERT etc., so we ask SQLite, if we have the prepared statement.  (If not,
+    // we take it that it changes data: a SELECT in our savepoint does no harm.)
+    //
+    bool
+    changes_data(const char *sql_text, sqlite3_stmt *stmt) {
+        while (isspace(static_cast<unsigned char>(*sql_text)))  ++sql_text;
+        if (starts_with_keyword(sql_text, "WITH"))
+            return stmt == nullptr  ||  ! sqlite3_stmt_readonly(stmt);
+        for (const char *keyword: { "INSERT", "UPDATE", "DELETE", "REPLACE" })
+            if (starts_with_keyword(sql_text, keyword))
+                return true;
+        return false;
+    }
+
+    void
+    exec_or_ignore(sqlite3 *conn, const string &sql_text) {
+        sqlite3_exec(conn, sql_text.c_str(), nullptr, nullptr, nullptr);
+    }
+}
+
+
+// SQLite's hooks, which mustn't run any SQL, so they only move things about.
+//
+struct change_hooks {
+    static void
+    on_update(void *recorder, int op, const char *schema, const char *table, sqlite3_int64 rowid) {
+        change_recorder &self = *static_cast<change_recorder *>(recorder);
+        quince::binomen name;
+        if (strcmp(schema, "main") != 0)  name._enclosure = string(schema);
+        name._local = table;
+        self._pending.push_back({ name, to_change_operation(op), int64_t(rowid) });
+    }
+
+    static int
+    on_commit(void *recorder) {
+        change_recorder &self = *static_cast<change_recorder *>(recorder);
+        vector<row_change> &committed = self._committed._changes;
+        committed.insert(committed.end(), self._pending.begin(), self._pending.end());
+        self._pending.clear();
+        self._committed._changeset = std::move(self._changeset);
+        self._changeset.clear();
+        self._session_stale = true;
+        return 0;
+    }
+
+    static void
+    on_rollback(void *recorder) {
+        change_recorder &self = *static_cast<change_recorder *>(recorder);
+        self._pending.clear();
+        self._changeset.clear();
+        self._committed = committed_changes();
+        self._session_stale = true;
+    }
+
+    // Does nothing, but while there is a preupdate hook, SQLite deletes rows one by one,
+    // instead of truncating the table without telling the update hook.  (A session object
+    // installs a preupdate hook of its own, to the same effect.)
+    //
+    static void
+    on_preupdate(void *, sqlite3 *, int, const char *, const char *, sqlite3_int64, sqlite3_int64)
+    {}
+};
+
+
+change_feed::change_feed() :
+    _next_subscription(1)
+{}
+
+uint64_t
+change_feed::subscribe(change_subscriber subscriber) {
+    const std::lock_guard<std::mutex> lock(_mutex);
+    const uint64_t result = _next_subscription++;
+    _subscribers.emplace(result, std::make_shared<const change_subscriber>(std::move(subscriber)));
+    return result;
+}
+
+void
+change_feed::unsubscribe(uint64_t subscription) {
+    const std::lock_guard<std::mutex> lock(_mutex);
+    _subscribers.erase(subscription);
+}
+
+// The subscribers are called without the lock held, so that they may subscribe or unsubscribe.
+//
+void
+change_feed::publish(const committed_changes &changes) const {
+    vector<shared_ptr<const change_subscriber>> subscribers;
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        for (const auto &s: _subscribers)
+            subscribers.push_back(s.second);
+    }
+    for (const shared_ptr<const change_subscriber> &s: subscribers)
+        try {
+            (*s)(changes);
+        }
+        catch (...) {}
+}
+
+
+change_recorder::change_recorder(sqlite3 *conn, change_feed &feed, bool with_changesets) :
+    _conn(conn),
+    _feed(feed),
+    _with_changesets(with_changesets),
+    _session(nullptr),
+    _pending_at_statement_start(0),
+    _was_autocommit(true),
+    _wrapped(false),
+    _session_stale(false)
+{
+    if (_with_changesets)
+        restart_session();
+    else
+        sqlite3_preupdate_hook(_conn, &change_hooks::on_preupdate, nullptr);
+    sqlite3_update_hook(_conn, &change_hooks::on_update, this);
+    sqlite3_commit_hook(_conn, &change_hooks::on_commit, this);
+    sqlite3_rollback_hook(_conn, &change_hooks::on_rollback, this);
+}
+
+change_recorder::~change_recorder() {
+    sqlite3_rollback_hook(_conn, nullptr, nullptr);
+    sqlite3_commit_hook(_conn, nullptr, nullptr);
+    sqlite3_update_hook(_conn, nullptr, nullptr);
+    if (_session)  sqlite3session_delete(_session);
+    else           sqlite3_preupdate_hook(_conn, nullptr, nullptr);
+}
+
+void
+change_recorder::before_statement(const char *sql_text, sqlite3_stmt *stmt) {
+    _was_autocommit = sqlite3_get_autocommit(_conn) != 0;
+    _pending_at_statement_start = _pending.size();
+    if (! _with_changesets)  return;
+
+    if (! _was_autocommit) {
+        if (commits(sql_text))  take_changeset();
+    }
+    else if (changes_data(sql_text, stmt)) {
+        const string begin = string("SAVEPOINT ") + capture_savepoint;
+        _wrapped = sqlite3_exec(_conn, begin.c_str(), nullptr, nullptr, nullptr) == SQLITE_OK;
+    }
+}
+
+void
+change_recorder::after_statement(const char *sql_text, int result_code) {
+    const bool succeeded = result_code == SQLITE_DONE  ||  result_code == SQLITE_OK;
+    if (succeeded)
+        follow_transaction_control(sql_text);
+    else
+        _pending.resize(std::min(_pending.size(), _pending_at_statement_start));   // SQLite has undone the statement
+
+    if (_wrapped) {
+        _wrapped = false;
+        if (succeeded)  take_changeset();
+        else            exec_or_ignore(_conn, string("ROLLBACK TO ") + capture_savepoint);
+        exec_or_ignore(_conn, string("RELEASE ") + capture_savepoint);
+    }
+
+    if (! sqlite3_get_autocommit(_conn))  return;
+
+    _savepoints.clear();
+    if (_session_stale)  restart_session();
+    if (! _committed._changes.empty()  ||  ! _committed._changeset.empty()) {
+        committed_changes published;
+        std::swap(published, _committed);
+        _feed.publish(published);
+    }
+}
+
+bool
+change_recorder::commits(const char *sql_text) const {
+    if (! is_transaction_control(sql_text))  return false;
+
+    const vector<string> w = words(sql_text);
+    if (w.empty())  return false;
+    if (w[0] == "COMMIT"  ||  w[0] == "END")  return true;
+
+    const optional<string> released = release_name(w);
+    if (! released)  return false;
+    for (auto i = _savepoints.rbegin(); i != _savepoints.rend(); ++i)
+        if (same_name(i->_name, *released))
+            return i + 1 == _savepoints.rend()  &&  i->_began_transaction;
+    return false;
+}
+
+// SQLite finds a savepoint by name, innermost first.  Releasing it releases everything inside
+// it, and rolling back to it leaves it in place.
+//
+void
+change_recorder::follow_transaction_control(const char *sql_text) {
+    if (! is_transaction_control(sql_text))  return;
+
+    const vector<string> w = words(sql_text);
+    if (w.size() == 2  &&  w[0] == "SAVEPOINT") {
+        _savepoints.push_back({ w[1], _pending.size(), _was_autocommit });
+        return;
+    }
+
+    const optional<string> released = release_name(w);
+    const optional<string> rolled_back_to = rollback_to_name(w);
+    const optional<string> &name = released ? released : rolled_back_to;
+    if (! name)  return;
+
+    auto found = _savepoints.end();
+    for (auto i = _savepoints.begin(); i != _savepoints.end(); ++i)
+        if (same_name(i->_name, *name))  found = i;
+    if (found == _savepoints.end())  return;
+
+    if (rolled_back_to) {
+        _pending.resize(std::min(_pending.size(), found->_pending_before));
+        ++found;
+    }
+    _savepoints.erase(found, _savepoints.end());
+}
+
+void
+change_recorder::take_changeset() {
+    assert(_session);
+    int size = 0;
+    void *data = nullptr;
+    if (sqlite3session_changeset(_session, &size, &data) == SQLITE_OK  &&  data != nullptr)
+        _changeset.assign(static_cast<const char *>(data), size_t(size));
+    else
+        _changeset.clear();
+    sqlite3_free(data);
+}
+
+// A session object accumulates changes for as long as it exists, so we start a new one for
+// each transaction.
+//
+void
+change_recorder::restart_session() {
+    _session_stale = false;
+    if (! _with_changesets)  return;
+
+    if (_session)  sqlite3session_delete(_session);
+    _session = nullptr;
+    if (sqlite3session_create(_conn, "main", &_session) != SQLITE_OK) {
+        _session = nullptr;
+        throw dbms_exception(string(sqlite3_errmsg(_conn)) + " (while creating a session object)");
+    }
+    sqlite3session_attach(_session, nullptr);
+}
+
+
+void
+apply_changeset(sqlite3 *conn, const string &changeset, changeset_conflict on_conflict) {
+    const auto on_conflict_callback = [](void *policy, int reason, sqlite3_changeset_iter *) -> int {
+        switch (*static_cast<const changeset_conflict *>(policy)) {
+            case changeset_conflict::abort:
+                return SQLITE_CHANGESET_ABORT;
+            case changeset_conflict::replace:
+                if (reason == SQLITE_CHANGESET_DATA  ||  reason == SQLITE_CHANGESET_CONFLICT)
+                    return SQLITE_CHANGESET_REPLACE;
+                return SQLITE_CHANGESET_OMIT;
+            default:
+                return SQLITE_CHANGESET_OMIT;
+        }
+    };
+
+    changeset_conflict policy = on_conflict;
+    const int result_code = sqlite3changeset_apply(
+        conn,
+        int(changeset.size()),
+        const_cast<char *>(changeset.data()),
+        nullptr,
+        on_conflict_callback,
+        &policy
+    );
+    if (result_code != SQLITE_OK)
+        throw dbms_exception(string(sqlite3_errstr(result_code)) + " (while applying a changeset)");
+}
+
+}
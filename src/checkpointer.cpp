@@ -0,0 +1,128 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <boost/filesystem/operations.hpp>
+#include <sqlite3.h>
+#include <quince_sqlite/detail/checkpointer.h>
+
+using boost::optional;
+using std::string;
+
+
+namespace quince_sqlite {
+
+namespace {
+    const int64_t wal_frame_header_bytes = 24;
+
+    // The WAL file's name is the database file's name with "-wal" appended.  There is no WAL
+    // file for an in-memory or temporary database, so we return an empty string.
+    //
+    string
+    wal_filename(sqlite3 *conn) {
+        const char * const db_filename = sqlite3_db_filename(conn, "main");
+        return db_filename && *db_filename  ?  string(db_filename) + "-wal"  :  string();
+    }
+
+    int64_t
+    pragma_value(sqlite3 *conn, const char *sql_text) {
+        sqlite3_stmt *stmt = nullptr;
+        int64_t result = -1;
+        if (sqlite3_prepare_v2(conn, sql_text, -1, &stmt, nullptr) == SQLITE_OK  &&  sqlite3_step(stmt) == SQLITE_ROW)
+            result = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+        return result;
+    }
+
+    int64_t
+    file_size(const string &filename) {
+        boost::system::error_code error;
+        const boost::uintmax_t result = boost::filesystem::file_size(filename, error);
+        return error ? 0 : int64_t(result);
+    }
+
+    // Changes whenever another connection commits.
+    //
+    int64_t
+    data_version(sqlite3 *conn) {
+        return pragma_value(conn, "PRAGMA data_version");
+    }
+}
+
+
+checkpointer::checkpointer(const connection_spec &spec) :
+    _schedule(spec._settings._checkpoints),
+    _connection(spec),
+    _wal_filename(wal_filename(_connection.handle())),
+    _latest_activity(clock::now().time_since_epoch().count()),
+    _checkpointed_data_version(-1),
+    _backlog(false),
+    _stopping(false),
+    _thread([this] { run(); })
+{}
+
+checkpointer::~checkpointer() {
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _stop_requested.notify_one();
+    _thread.join();
+}
+
+void
+checkpointer::run() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (! _stop_requested.wait_for(lock, _schedule._poll_interval, [this] { return _stopping; })) {
+        lock.unlock();
+        poll();
+        lock.lock();
+    }
+}
+
+// The WAL file only shrinks when a TRUNCATE checkpoint empties it, so its size tells us how
+// far the WAL has ever grown, not how much of it is waiting to be checkpointed.  That comes
+// from the frame counts that each checkpoint reports, so after a checkpoint that caught up,
+// we don't run another until some other connection has committed.
+//
+// A checkpoint that can't finish, because of readers or a concurrent writer, is not an error
+// for us: we'll try again at the next poll.
+//
+void
+checkpointer::poll() {
+    if (_wal_filename.empty())  return;
+
+    const int64_t wal_size = file_size(_wal_filename);
+    const clock::duration idle = clock::now().time_since_epoch() - clock::duration(_latest_activity);
+
+    if (wal_size > _schedule._truncate_threshold_bytes  &&  idle >= _schedule._idle_time) {
+        checkpoint(SQLITE_CHECKPOINT_TRUNCATE);
+        return;
+    }
+    if (wal_size <= _schedule._passive_threshold_bytes)  return;
+    if (! _backlog  &&  data_version(_connection.handle()) == _checkpointed_data_version)  return;
+
+    // If the PASSIVE checkpoint catches up, but the WAL is already past the truncate threshold,
+    // a RESTART makes the next writer go back to the start of the file instead of growing it.
+    // Unlike PASSIVE, it waits for readers, as far as the busy policy allows.
+    //
+    const int64_t log_bytes = checkpoint(SQLITE_CHECKPOINT_PASSIVE);
+    if (! _backlog  &&  log_bytes > _schedule._truncate_threshold_bytes)
+        checkpoint(SQLITE_CHECKPOINT_RESTART);
+}
+
+int64_t
+checkpointer::checkpoint(int mode) {
+    sqlite3 * const conn = _connection.handle();
+    const int64_t version = data_version(conn);     // taken first, so that a commit during the checkpoint counts as new
+    int log_frames = 0;
+    int checkpointed_frames = 0;
+    const int result_code = sqlite3_wal_checkpoint_v2(conn, nullptr, mode, &log_frames, &checkpointed_frames);
+
+    _backlog = result_code != SQLITE_OK  ||  checkpointed_frames < log_frames;
+    _checkpointed_data_version = version;
+    return int64_t(log_frames) * (pragma_value(conn, "PRAGMA page_size") + wal_frame_header_bytes);
+}
+
+}
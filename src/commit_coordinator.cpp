@@ -0,0 +1,131 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <exception>
+#include <quince/transaction.h>
+#include <quince_sqlite/database.h>
+#include <quince_sqlite/detail/commit_coordinator.h>
+
+using std::exception_ptr;
+using std::function;
+using std::future;
+using std::vector;
+
+
+namespace quince_sqlite {
+
+commit_coordinator::commit_coordinator(const database &db, const group_commit_policy &policy) :
+    _database(db),
+    _policy(policy),
+    _stopping(false),
+    _statistics(),
+    _thread([this] { run(); })
+{}
+
+commit_coordinator::~commit_coordinator() {
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _changed.notify_one();
+    _thread.join();
+}
+
+future<void>
+commit_coordinator::submit(function<void()> &&unit) {
+    pending_unit p;
+    p._unit = std::move(unit);
+    future<void> result = p._promise.get_future();
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        if (_pending.empty())  _first_pending_at = clock::now();
+        _pending.push_back(std::move(p));
+    }
+    _changed.notify_one();
+    return result;
+}
+
+group_commit_statistics
+commit_coordinator::get_statistics() const {
+    const std::lock_guard<std::mutex> lock(_mutex);
+    return _statistics;
+}
+
+// A gathering closes when it reaches _max_units, or when _window has passed since its first
+// unit arrived, whichever is sooner.  Units still pending at destruction are committed first.
+//
+void
+commit_coordinator::run() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;) {
+        _changed.wait(lock, [this] { return ! _pending.empty()  ||  _stopping; });
+        if (_pending.empty())  return;
+
+        _changed.wait_until(lock, _first_pending_at + _policy._window, [this] {
+            return _pending.size() >= _policy._max_units  ||  _stopping;
+        });
+
+        vector<pending_unit> gathering;
+        if (_pending.size() <= _policy._max_units)
+            gathering.swap(_pending);
+        else {
+            gathering.assign(
+                std::make_move_iterator(_pending.begin()),
+                std::make_move_iterator(_pending.begin() + _policy._max_units)
+            );
+            _pending.erase(_pending.begin(), _pending.begin() + _policy._max_units);
+            _first_pending_at = clock::now();
+        }
+
+        lock.unlock();
+        commit(gathering);
+        lock.lock();
+    }
+}
+
+// quince makes a transaction inside a transaction into a savepoint, so each unit can be
+// rolled back alone.  The futures are only settled once we know the outcome of the COMMIT.
+//
+void
+commit_coordinator::commit(vector<pending_unit> &gathering) {
+    const clock::time_point started = clock::now();
+    vector<exception_ptr> failures(gathering.size());
+    exception_ptr commit_failure;
+    try {
+        quince::transaction txn(_database);
+        for (size_t i = 0; i < gathering.size(); i++)
+            try {
+                quince::transaction unit_txn(_database);
+                gathering[i]._unit();
+                unit_txn.commit();
+            }
+            catch (...) {
+                failures[i] = std::current_exception();
+            }
+        txn.commit();
+    }
+    catch (...) {
+        commit_failure = std::current_exception();
+    }
+    const uint64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - started).count();
+
+    uint64_t failed_units = 0;
+    for (size_t i = 0; i < gathering.size(); i++)
+        if (failures[i]) {
+            gathering[i]._promise.set_exception(failures[i]);
+            failed_units++;
+        }
+        else if (commit_failure)
+            gathering[i]._promise.set_exception(commit_failure);
+        else
+            gathering[i]._promise.set_value();
+
+    const std::lock_guard<std::mutex> lock(_mutex);
+    _statistics._units_per_commit.record(gathering.size());
+    _statistics._commit_microseconds.record(elapsed);
+    _statistics._failed_units += failed_units;
+}
+
+}
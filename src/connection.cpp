@@ -0,0 +1,428 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <iterator>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <quince/exceptions.h>
+#include <quince/detail/util.h>
+#include <sqlite3.h>
+#include <quince_sqlite/detail/change_feed.h>
+#include <quince_sqlite/detail/connection.h>
+
+using boost::optional;
+using namespace quince;
+using std::string;
+using std::to_string;
+using std::vector;
+
+
+namespace quince_sqlite {
+
+namespace {
+    void
+    finalize(sqlite3_stmt *stmt) {
+        if (stmt != nullptr)  sqlite3_finalize(stmt);
+    }
+
+    // SQLite re-prepares a statement by itself if the schema changes under it, but there is
+    // no point keeping plans that may refer to things that have just been dropped or detached.
+    //
+    bool
+    changes_schema(const string &sql_text) {
+        for (const char *keyword: { "CREATE ", "DROP ", "ALTER ", "ATTACH ", "DETACH " })
+            if (sqlite3_strnicmp(sql_text.c_str(), keyword, int(strlen(keyword))) == 0)
+                return true;
+        return false;
+    }
+
+    const char *
+    keyword(journal_mode mode) {
+        switch (mode) {
+            case journal_mode::delete_:     return "DELETE";
+            case journal_mode::truncate:    return "TRUNCATE";
+            case journal_mode::persist:     return "PERSIST";
+            case journal_mode::memory:      return "MEMORY";
+            case journal_mode::wal:         return "WAL";
+            case journal_mode::off:         return "OFF";
+            default:                        abort();
+        }
+    }
+
+    const char *
+    keyword(synchronous level) {
+        switch (level) {
+            case synchronous::off:      return "OFF";
+            case synchronous::normal:   return "NORMAL";
+            case synchronous::full:     return "FULL";
+            case synchronous::extra:    return "EXTRA";
+            default:                    abort();
+        }
+    }
+
+    const char *
+    keyword(temp_store store) {
+        switch (store) {
+            case temp_store::default_:  return "DEFAULT";
+            case temp_store::file:      return "FILE";
+            case temp_store::memory:    return "MEMORY";
+            default:                    abort();
+        }
+    }
+
+    // The background checkpointer, if enabled, does all the checkpointing.
+    //
+    connection_tuning
+    effective_tuning(const settings &s) {
+        connection_tuning result = s._tuning;
+        if (s._checkpoints._enabled)  result._wal_autocheckpoint = 0;
+        return result;
+    }
+
+    void
+    apply_tuning(sqlite3 *conn, const connection_tuning &tuning, bool read_only) {
+        for (const string &pragma: tuning_pragmas(tuning, read_only)) {
+            char *message = nullptr;
+            if (sqlite3_exec(conn, pragma.c_str(), nullptr, nullptr, &message) != SQLITE_OK) {
+                const string what(message ? message : sqlite3_errmsg(conn));
+                sqlite3_free(message);
+                throw dbms_exception(what + " (while running `" + pragma + "' on a new connection)");
+            }
+        }
+    }
+
+    sqlite3 *
+    connect(const connection_spec &spec, int (*busy_handler)(void *, int), void *busy_handler_arg) {
+        sqlite3 *result;
+        int result_code = sqlite3_open_v2(
+            spec._filename.c_str(),
+            &result,
+            spec._flags,
+            spec._vfs_module_name ? spec._vfs_module_name->c_str() : nullptr
+        );
+        if (result_code != SQLITE_OK) {
+            if (result != nullptr)  sqlite3_close(result);
+            throw failed_connection_exception();
+        }
+        assert(result != nullptr);
+        sqlite3_extended_result_codes(result, true);
+        sqlite3_busy_handler(result, busy_handler, busy_handler_arg);
+        try {
+            apply_tuning(result, effective_tuning(spec._settings), (spec._flags & SQLITE_OPEN_READONLY) != 0);
+        }
+        catch (...) {
+            sqlite3_close(result);
+            throw;
+        }
+        return result;
+    }
+
+    struct unlock_notification {
+        bool _fired;
+        std::mutex _mutex;
+        std::condition_variable _cond;
+    };
+
+    void
+    notify_unlocked(void **notifications, int count) {
+        for (int i = 0; i < count; i++) {
+            const auto n = static_cast<unlock_notification *>(notifications[i]);
+            const std::lock_guard<std::mutex> lock(n->_mutex);
+            n->_fired = true;
+            n->_cond.notify_one();
+        }
+    }
+
+    // Blocks until the connection that holds the lock we tripped over finishes its transaction.
+    // Returns SQLITE_LOCKED if SQLite sees that waiting would deadlock.
+    //
+    int
+    wait_for_unlock_notify(sqlite3 *conn) {
+        unlock_notification n;
+        n._fired = false;
+        const int result = sqlite3_unlock_notify(conn, notify_unlocked, &n);
+        assert(result == SQLITE_LOCKED  ||  result == SQLITE_OK);
+        if (result == SQLITE_OK) {
+            std::unique_lock<std::mutex> lock(n._mutex);
+            n._cond.wait(lock, [&] { return n._fired; });
+        }
+        return result;
+    }
+
+    std::chrono::microseconds
+    since(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    }
+}
+
+
+busy_statistics
+busy_counters::get_statistics() const {
+    return { _waits, double(_blocked_microseconds) / 1e6 };
+}
+
+
+bool
+sqlite_version_at_least(int version_number) {
+    return sqlite3_libversion_number() >= version_number;
+}
+
+
+vector<string>
+tuning_pragmas(const connection_tuning &tuning, bool read_only, const optional<string> &schema) {
+    const string prefix = "PRAGMA " + (schema ? "\"" + *schema + "\"." : string());
+    vector<string> result;
+
+    // page_size must come first: it can't be changed once the database is in WAL mode.
+    //
+    if (! read_only) {
+        if (tuning._page_size)      result.push_back(prefix + "page_size=" + to_string(*tuning._page_size));
+        if (tuning._journal_mode)   result.push_back(prefix + "journal_mode=" + keyword(*tuning._journal_mode));
+    }
+    if (tuning._synchronous)        result.push_back(prefix + "synchronous=" + keyword(*tuning._synchronous));
+    if (tuning._cache_size)         result.push_back(prefix + "cache_size=" + to_string(*tuning._cache_size));
+    if (tuning._mmap_size)          result.push_back(prefix + "mmap_size=" + to_string(*tuning._mmap_size));
+    if (! schema) {
+        if (tuning._temp_store)         result.push_back(prefix + "temp_store=" + keyword(*tuning._temp_store));
+        if (tuning._wal_autocheckpoint) result.push_back(prefix + "wal_autocheckpoint=" + to_string(*tuning._wal_autocheckpoint));
+    }
+    return result;
+}
+
+
+statement_cache_statistics &
+statement_cache_statistics::operator+=(const statement_cache_statistics &other) {
+    _hits += other._hits;
+    _misses += other._misses;
+    _evictions += other._evictions;
+    return *this;
+}
+
+
+statement_cache::statement_cache(sqlite3 *conn, size_t capacity) :
+    _conn(conn),
+    _capacity(capacity),
+    _hits(0),
+    _misses(0),
+    _evictions(0)
+{}
+
+statement_cache::~statement_cache() {
+    evict_all();
+}
+
+statement_cache::prepared
+statement_cache::acquire(const string &sql_text, int &result_code, bool &was_cached) {
+    const auto found = _index.find(sql_text);
+    was_cached = found != _index.end();
+    if (! was_cached) {
+        _misses++;
+        return { prepare(sql_text, result_code), {}, -1 };
+    }
+    prepared result = std::move(found->second->second);
+    _lru.erase(found->second);
+    _index.erase(found);
+    _hits++;
+    result_code = SQLITE_OK;
+    return result;
+}
+
+void
+statement_cache::release(const string &sql_text, prepared &&p) {
+    if (p._stmt == nullptr)  return;
+
+    if (changes_schema(sql_text)) {
+        finalize(p._stmt);
+        evict_all();
+    }
+    else if (_capacity == 0  ||  _index.count(sql_text) != 0)
+        finalize(p._stmt);
+    else {
+        sqlite3_reset(p._stmt);
+        sqlite3_clear_bindings(p._stmt);
+        while (_lru.size() >= _capacity)  evict(_lru.begin());
+        _lru.emplace_back(sql_text, std::move(p));
+        _index.emplace(sql_text, std::prev(_lru.end()));
+    }
+}
+
+void
+statement_cache::evict_all() {
+    while (! _lru.empty())  evict(_lru.begin());
+}
+
+statement_cache_statistics
+statement_cache::get_statistics() const {
+    return { _hits, _misses, _evictions };
+}
+
+sqlite3_stmt *
+statement_cache::prepare(const string &sql_text, int &result_code) const {
+    sqlite3_stmt *result;
+    result_code = sqlite3_prepare_v2(_conn, sql_text.c_str(), -1, &result, nullptr);
+    if (result_code != SQLITE_OK) {
+        finalize(result);
+        return nullptr;
+    }
+    assert(result != nullptr);
+    return result;
+}
+
+void
+statement_cache::evict(lru_list::iterator pos) {
+    finalize(pos->second._stmt);
+    _index.erase(pos->first);
+    _lru.erase(pos);
+    _evictions++;
+}
+
+
+connection::connection(const connection_spec &spec) :
+    _busy_waiter({ spec._settings._busy, spec._busy_counters, std::chrono::steady_clock::time_point() }),
+    _handle(connect(spec, &busy_waiter::handle_busy, &_busy_waiter)),
+    _read_only((spec._flags & SQLITE_OPEN_READONLY) != 0),
+    _statements(_handle, spec._settings._statement_cache_capacity),
+    _changes(
+        spec._change_feed  &&  ! _read_only
+            ? quince::make_unique<change_recorder>(
+                _handle,
+                *spec._change_feed,
+                spec._settings._change_capture == change_capture::feed_and_changesets
+            )
+            : nullptr
+    )
+{}
+
+connection::~connection() {
+    _changes.reset();
+    _statements.evict_all();
+    sqlite3_close(_handle);
+}
+
+void
+connection::exec(const string &sql_text) {
+    if (_changes)  _changes->before_statement(sql_text.c_str(), nullptr);
+    char *message = nullptr;
+    const int result_code = sqlite3_exec(_handle, sql_text.c_str(), nullptr, nullptr, &message);
+    if (_changes)  _changes->after_statement(sql_text.c_str(), result_code);
+    if (result_code != SQLITE_OK) {
+        const string what(message ? message : sqlite3_errmsg(_handle));
+        sqlite3_free(message);
+        throw dbms_exception(what + " (while running `" + sql_text + "')");
+    }
+}
+
+void
+connection::attach(const vector<attachment> &needed) {
+    for (const attachment &a: needed) {
+        const auto found = std::find(_attached.begin(), _attached.end(), a._name);
+        if (found != _attached.end()) {
+            _attached.splice(_attached.end(), _attached, found);
+            continue;
+        }
+
+        const size_t limit = size_t(sqlite3_limit(_handle, SQLITE_LIMIT_ATTACHED, -1));
+        for (auto candidate = _attached.begin(); candidate != _attached.end()  &&  _attached.size() >= limit; ) {
+            const bool is_needed = std::any_of(needed.begin(), needed.end(), [&](const attachment &n) {
+                return n._name == *candidate;
+            });
+            if (! is_needed  &&  sqlite3_get_autocommit(_handle)) {
+                try {
+                    attach_or_detach(string(), *candidate);
+                    candidate = _attached.erase(candidate);
+                    continue;
+                }
+                catch (const dbms_exception &) {}   // e.g. a statement is still reading from it
+            }
+            ++candidate;
+        }
+
+        attach_or_detach(a._filename, a._name);
+        _attached.push_back(a._name);
+        for (const string &pragma: tuning_pragmas(a._tuning, _read_only, a._name))
+            exec(pragma);
+    }
+}
+
+// ATTACH and DETACH take expressions, so we can bind the names instead of quoting them.  An
+// empty filename means DETACH.
+//
+void
+connection::attach_or_detach(const string &filename, const string &name) {
+    const char * const sql_text = filename.empty() ? "DETACH ?1" : "ATTACH ?2 AS ?1";
+    sqlite3_stmt *stmt = nullptr;
+    int result_code = sqlite3_prepare_v2(_handle, sql_text, -1, &stmt, nullptr);
+    if (result_code == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, name.c_str(), int(name.size()), SQLITE_STATIC);
+        if (! filename.empty())
+            sqlite3_bind_text(stmt, 2, filename.c_str(), int(filename.size()), SQLITE_STATIC);
+        result_code = sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+    if (result_code != SQLITE_DONE)
+        throw dbms_exception(string(sqlite3_errmsg(_handle)) + " (while " + (filename.empty() ? "detaching " : "attaching ") + name + ")");
+}
+
+int
+connection::step(sqlite3_stmt *stmt, uint64_t rows_so_far) {
+    if (_changes  &&  rows_so_far == 0)
+        _changes->before_statement(sqlite3_sql(stmt), stmt);
+
+    int result;
+    while ((result = sqlite3_step(stmt)) == SQLITE_LOCKED_SHAREDCACHE
+           &&  _busy_waiter._policy._unlock_notify
+           &&  rows_so_far == 0) {
+        const std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+        const int wait_result = wait_for_unlock_notify(_handle);
+        if (_busy_waiter._counters) {
+            _busy_waiter._counters->_waits++;
+            _busy_waiter._counters->_blocked_microseconds += since(started).count();
+        }
+        if (wait_result != SQLITE_OK)  break;
+        sqlite3_reset(stmt);
+    }
+    if (_changes  &&  result != SQLITE_ROW)  _changes->after_statement(sqlite3_sql(stmt), result);
+    return result;
+}
+
+// SQLite calls this each time it finds the database locked, with prior_calls counting up from
+// 0 for as long as the same lock stays in the way.  Returning 0 tells it to give up.
+//
+int
+connection::busy_waiter::handle_busy(void *waiter, int prior_calls) {
+    busy_waiter &self = *static_cast<busy_waiter *>(waiter);
+    const busy_policy &policy = self._policy;
+
+    if (prior_calls == 0)  self._started = std::chrono::steady_clock::now();
+    const std::chrono::microseconds remaining = policy._timeout - since(self._started);
+    if (remaining.count() <= 0)  return 0;
+
+    // Only now do we know that we're going to wait.
+    //
+    if (prior_calls == 0  &&  self._counters)  self._counters->_waits++;
+
+    std::chrono::microseconds backoff = policy._max_backoff;
+    if (prior_calls < 30)
+        backoff = std::min(backoff, policy._initial_backoff * (int64_t(1) << prior_calls));
+
+    static thread_local std::minstd_rand random(std::random_device{}());
+    const double shortening = policy._jitter * std::uniform_real_distribution<double>(0, 1)(random);
+    backoff = std::min(
+        remaining,
+        std::chrono::microseconds(int64_t(double(backoff.count()) * (1 - shortening)))
+    );
+
+    std::this_thread::sleep_for(backoff);
+    if (self._counters)  self._counters->_blocked_microseconds += backoff.count();
+    return 1;
+}
+
+}
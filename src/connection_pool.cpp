@@ -0,0 +1,167 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <assert.h>
+#include <quince/exceptions.h>
+#include <quince/detail/util.h>
+#include <sqlite3.h>
+#include <quince_sqlite/detail/connection_pool.h>
+
+using boost::optional;
+using namespace quince;
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+
+
+namespace quince_sqlite {
+
+namespace {
+    // Readers and writers must each have a private cache: in a shared cache, SQLite's
+    // table-level locking would serialize the readers behind the writer, WAL or no WAL.
+    //
+    int
+    writer_flags(int flags) {
+        return (flags & ~SQLITE_OPEN_SHAREDCACHE) | SQLITE_OPEN_PRIVATECACHE;
+    }
+
+    int
+    reader_flags(int flags) {
+        return (writer_flags(flags) & ~(SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE)) | SQLITE_OPEN_READONLY;
+    }
+
+    void
+    exec_simple(sqlite3 *conn, const string &sql_text) {
+        sqlite3_exec(conn, sql_text.c_str(), nullptr, nullptr, nullptr);
+    }
+
+    // Filenames that give each connection a database of its own, so that a pool's writer and
+    // readers wouldn't be looking at the same data.
+    //
+    bool
+    is_private_to_each_connection(const string &filename) {
+        return filename.empty()
+            || filename == ":memory:"
+            || (filename.compare(0, 5, "file:") == 0  &&  filename.find("mode=memory") != string::npos);
+    }
+}
+
+
+connection_pool::connection_pool(const connection_spec &spec) :
+    _writer_wait_timeout(spec._settings._busy._timeout),
+    _filled_at(clock::now()),
+    _checkouts(0),
+    _waits(0),
+    _total_wait(clock::duration::zero())
+{
+    if (is_private_to_each_connection(spec._filename))  throw unsupported_exception();
+
+    _writers._size = 1;
+    _writers._busy_seconds = 0;
+    _readers._size = spec._settings._pooled_readers;
+    _readers._busy_seconds = 0;
+
+    // The writer goes first, so that the file is in WAL mode before any reader opens it.
+    //
+    const auto fill = [&](tier &t, int member_flags) {
+        connection_spec member_spec = spec;
+        member_spec._flags = member_flags;
+        for (size_t i = 0; i < t._size; i++) {
+            auto m = quince::make_unique<member>();
+            m->_connection = quince::make_unique<connection>(member_spec);
+            _all.push_back(m->_connection.get());
+            exec_simple(m->_connection->handle(), "SELECT count(*) FROM sqlite_master");  // loads the schema
+            t._idle.push_back(std::move(m));
+        }
+    };
+    fill(_writers, writer_flags(spec._flags));
+    exec_simple(_writers._idle.front()->_connection->handle(), "PRAGMA journal_mode=WAL");
+    fill(_readers, reader_flags(spec._flags));
+}
+
+connection_pool::~connection_pool() {
+    assert(_readers._idle.size() == _readers._size);
+    assert(_writers._idle.size() == _writers._size);
+}
+
+shared_ptr<connection>
+connection_pool::acquire_reader() {
+    return acquire(_readers);
+}
+
+shared_ptr<connection>
+connection_pool::acquire_writer() {
+    return acquire(_writers);
+}
+
+connection_pool_statistics
+connection_pool::get_statistics() const {
+    const std::lock_guard<std::mutex> lock(_mutex);
+    const double elapsed = std::chrono::duration<double>(clock::now() - _filled_at).count();
+    const auto utilisation = [&](const tier &t) {
+        return t._size == 0  ||  elapsed <= 0 ? 0.0 : t._busy_seconds / (double(t._size) * elapsed);
+    };
+    return {
+        _readers._size,
+        _writers._size,
+        _checkouts,
+        _waits,
+        std::chrono::duration<double>(_total_wait).count(),
+        utilisation(_readers),
+        utilisation(_writers)
+    };
+}
+
+statement_cache_statistics
+connection_pool::get_statement_cache_statistics() const {
+    statement_cache_statistics result = { 0, 0, 0 };
+    for (const connection *c: _all)
+        result += c->statements().get_statistics();
+    return result;
+}
+
+shared_ptr<connection>
+connection_pool::acquire(tier &t) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (t._idle.empty()) {
+        const clock::time_point start = clock::now();
+        const auto idle = [&] { return ! t._idle.empty(); };
+        bool found = true;
+        if (&t == &_writers)
+            found = t._became_idle.wait_for(lock, _writer_wait_timeout, idle);
+        else
+            t._became_idle.wait(lock, idle);
+        _waits++;
+        _total_wait += clock::now() - start;
+        if (! found)
+            throw deadlock_exception("timed out waiting for the connection pool's writer");
+    }
+    unique_ptr<member> m = std::move(t._idle.back());
+    t._idle.pop_back();
+
+    _checkouts++;
+    m->_checked_out_at = clock::now();
+
+    member * const checked_out = m.release();
+    return shared_ptr<connection>(
+        checked_out->_connection.get(),
+        [this, &t, checked_out](connection *) { give_back(t, checked_out); }
+    );
+}
+
+// If a session goes away in the middle of a transaction, its transaction goes with it.
+//
+void
+connection_pool::give_back(tier &t, member *m) {
+    sqlite3 * const handle = m->_connection->handle();
+    if (! sqlite3_get_autocommit(handle))  exec_simple(handle, "ROLLBACK");
+
+    const std::lock_guard<std::mutex> lock(_mutex);
+    t._busy_seconds += std::chrono::duration<double>(clock::now() - m->_checked_out_at).count();
+    t._idle.emplace_back(m);
+    t._became_idle.notify_one();
+}
+
+}
@@ -3,6 +3,7 @@
 //    (See accompanying file ../LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 
+#include <algorithm>
 #include <boost/filesystem/operations.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/utility/identity_type.hpp>
@@ -18,7 +19,9 @@
 #include <quince/transaction.h>
 #include <sqlite3.h>
 #include <quince_sqlite/database.h>
+#include <quince_sqlite/ptime_integer_mapper.h>
 #include <quince_sqlite/detail/dialect_sql.h>
+#include <quince_sqlite/detail/image.h>
 
 using namespace quince;
 using boost::optional;
@@ -38,6 +41,43 @@ QUINCE_SUPPRESS_MSVC_DOMINANCE_WARNING
 namespace quince_sqlite {
 
 namespace {
+    struct stmt_finalizer {
+        void operator()(sqlite3_stmt *stmt) const  { sqlite3_finalize(stmt); }
+    };
+    typedef unique_ptr<sqlite3_stmt, stmt_finalizer> finalizing_stmt;
+
+    // The inverse of boost::posix_time::to_simple_string(), which time_from_string() is, except
+    // for the special values.
+    //
+    ptime
+    ptime_from_text(const string &text) {
+        if (text == "not-a-date-time")  return ptime(boost::posix_time::not_a_date_time);
+        if (text == "+infinity")        return ptime(boost::posix_time::pos_infin);
+        if (text == "-infinity")        return ptime(boost::posix_time::neg_infin);
+        return boost::posix_time::time_from_string(text);
+    }
+
+    // The SQL function that convert_ptime_column_to_integer() registers, to convert a column's
+    // TEXT values to INTEGER microseconds (see ptime_integer_mapper.h) in one statement.
+    //
+    const char * const ptime_text_to_microseconds_name = "quince_sqlite_ptime_to_us";
+
+    void
+    ptime_text_to_microseconds(sqlite3_context *context, int, sqlite3_value **args) {
+        const unsigned char * const text = sqlite3_value_text(args[0]);
+        if (text == nullptr) {
+            sqlite3_result_null(context);
+            return;
+        }
+        const string t = reinterpret_cast<const char *>(text);
+        try {
+            sqlite3_result_int64(context, ptime_integer_mapper::to_microseconds(ptime_from_text(t)));
+        }
+        catch (const std::exception &) {
+            sqlite3_result_error(context, ("\"" + t + "\" is not a ptime").c_str(), -1);
+        }
+    }
+
     class ptime_mapper : public abstract_mapper<ptime>, public direct_mapper<string>
     {
     public:
@@ -55,7 +95,7 @@ namespace {
         virtual void from_row(const row &src, ptime &dest) const override {
             string text;
             direct_mapper<string>::from_row(src, text);
-            dest = boost::posix_time::time_from_string(text);
+            dest = ptime_from_text(text);
         }
 
         virtual void to_row(const ptime &src, row &dest) const override {
@@ -70,7 +110,7 @@ namespace {
     };
 
     struct customization_for_dbms : mapping_customization {
-        customization_for_dbms() {
+        explicit customization_for_dbms(ptime_storage storage) {
             customize<bool, numeric_cast_mapper<bool, direct_mapper<int64_t>>>();
             customize<int8_t, numeric_cast_mapper<int8_t, direct_mapper<int64_t>>>();
             customize<int16_t, numeric_cast_mapper<int16_t, direct_mapper<int64_t>>>();
@@ -85,7 +125,11 @@ namespace {
             customize<std::string, direct_mapper<std::string>>();
             customize<byte_vector, direct_mapper<byte_vector>>();
             customize<serial, serial_mapper>();
-            customize<ptime, ptime_mapper>();
+            switch (storage) {
+                case ptime_storage::text:       customize<ptime, ptime_mapper>();           break;
+                case ptime_storage::integer:    customize<ptime, ptime_integer_mapper>();   break;
+                default:                        abort();
+            }
         }
     };
 
@@ -106,27 +150,195 @@ database::database(
     bool share_cache,
     optional<string> vfs_module_name,
     const boost::optional<mapping_customization> &customization_for_db,
-    const filename_map &attachable_database_filenames
+    const filename_map &attachable_database_filenames,
+    const settings &tuning
 ) :
     quince::database(
         clone_or_null(customization_for_db),
-        quince::make_unique<customization_for_dbms>()
+        quince::make_unique<customization_for_dbms>(tuning._ptime_storage)
     ),
-    _spec({
-        filename,
-        (     (may_write ? SQLITE_OPEN_READWRITE : SQLITE_OPEN_READONLY)
-            | (mutex ? SQLITE_OPEN_FULLMUTEX : SQLITE_OPEN_NOMUTEX)
-            | (share_cache ? SQLITE_OPEN_SHAREDCACHE : SQLITE_OPEN_PRIVATECACHE)
-        ),
-        vfs_module_name
-    }),
-    _attachable_database_absolute_filenames(to_absolute_filename_strings(attachable_database_filenames))
-{}
+    _busy_counters(),
+    _change_feed(),
+    _spec(
+        tuning._load_image
+            ? session_impl::spec {
+                new_memdb_uri(),
+                SQLITE_OPEN_READONLY | SQLITE_OPEN_URI | (mutex ? SQLITE_OPEN_FULLMUTEX : SQLITE_OPEN_NOMUTEX),
+                boost::none,
+                tuning,
+                &_busy_counters,
+                nullptr
+            }
+            : session_impl::spec {
+                filename,
+                (     (may_write ? SQLITE_OPEN_READWRITE : SQLITE_OPEN_READONLY)
+                    | (mutex ? SQLITE_OPEN_FULLMUTEX : SQLITE_OPEN_NOMUTEX)
+                    | (share_cache ? SQLITE_OPEN_SHAREDCACHE : SQLITE_OPEN_PRIVATECACHE)
+                    | SQLITE_OPEN_URI
+                ),
+                tuning._instrument_io
+                    ? register_instrumented_vfs(vfs_module_name, tuning._read_ahead_bytes)
+                    : vfs_module_name,
+                tuning,
+                &_busy_counters,
+                tuning._change_capture == change_capture::off ? nullptr : &_change_feed
+            }
+    ),
+    _image(tuning._load_image ? load_image(filename, _spec._filename) : nullptr),
+    _attachable_database_absolute_filenames(to_absolute_filename_strings(attachable_database_filenames)),
+    _available_enclosure_count(0),
+    _pool(
+        tuning._pooled_readers == 0
+            ? nullptr
+            : quince::make_unique<connection_pool>(_spec)
+    ),
+    _checkpointer(
+        tuning._checkpoints._enabled
+            ? quince::make_unique<checkpointer>(_spec)
+            : nullptr
+    ),
+    _statement_profiler(tuning._profile_statements ? quince::make_unique<statement_profiler>() : nullptr),
+    _query_plan_advisor(tuning._advise_query_plans ? quince::make_unique<query_plan_advisor>() : nullptr),
+    _next_executor(0)
+{
+    if (tuning._group_commit._enabled)
+        _commit_coordinator = quince::make_unique<commit_coordinator>(*this, tuning._group_commit);
+    for (size_t i = 0; i < tuning._executor_threads; i++)
+        _executors.push_back(quince::make_unique<executor>());
+}
 
 
 database::~database()
 {}
 
+statement_cache_statistics
+database::get_statement_cache_statistics() const {
+    return get_session_impl()->get_statement_cache_statistics();
+}
+
+busy_statistics
+database::get_busy_statistics() const {
+    return _busy_counters.get_statistics();
+}
+
+map<string, statement_profile>
+database::get_statement_profiles() const {
+    if (! _statement_profiler)  return map<string, statement_profile>();
+    return _statement_profiler->get_profiles();
+}
+
+void
+database::write_statement_profiles_json(std::ostream &os) const {
+    if (_statement_profiler)  _statement_profiler->write_json(os);
+    else                      os << "[]";
+}
+
+void
+database::reset_statement_profiles() const {
+    if (_statement_profiler)  _statement_profiler->clear();
+}
+
+optional<connection_pool_statistics>
+database::get_connection_pool_statistics() const {
+    if (! _pool)  return boost::none;
+    return _pool->get_statistics();
+}
+
+void
+database::create_partial_index(
+    const binomen &table,
+    const string &index_name,
+    const vector<const abstract_mapper_base *> &key,
+    const abstract_predicate &predicate,
+    bool unique
+) const {
+    const unique_ptr<dialect_sql> cmd = make_dialect_sql();
+    cmd->write_create_partial_index(table, index_name, key, predicate, unique);
+    get_session()->exec(*cmd);
+}
+
+// The source is a connection of our own, rather than one of the sessions', so that SQLite
+// sees writes from the sessions as changes by another connection, and restarts the copy.
+//
+bool
+database::backup(const string &destination_filename, const backup_options &options, const optional<string> &enclosure) const {
+    const unique_ptr<connection> source = open_side_connection(enclosure);
+
+    const connection_spec dest_spec = {
+        destination_filename,
+        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_PRIVATECACHE,
+        boost::none,
+        settings(),
+        nullptr,
+        nullptr
+    };
+    connection dest(dest_spec);
+
+    return run_backup(source->handle(), enclosure.value_or("main"), dest.handle(), options);
+}
+
+void
+database::write_image(const string &image_filename, const optional<string> &enclosure) const {
+    const unique_ptr<connection> source = open_side_connection(enclosure);
+    save_image(source->handle(), enclosure.value_or("main"), image_filename);
+}
+
+std::future<void>
+database::submit_write(std::function<void()> unit) const {
+    if (_commit_coordinator)  return _commit_coordinator->submit(std::move(unit));
+
+    std::promise<void> result;
+    try {
+        transaction txn(*this);
+        unit();
+        txn.commit();
+        result.set_value();
+    }
+    catch (...) {
+        result.set_exception(std::current_exception());
+    }
+    return result.get_future();
+}
+
+group_commit_statistics
+database::get_group_commit_statistics() const {
+    if (! _commit_coordinator)  return group_commit_statistics();
+    return _commit_coordinator->get_statistics();
+}
+
+map<string, file_io_statistics>
+database::get_io_statistics() const {
+    return get_instrumented_vfs_statistics();
+}
+
+uint64_t
+database::subscribe_to_changes(change_subscriber subscriber) const {
+    return _change_feed.subscribe(std::move(subscriber));
+}
+
+void
+database::unsubscribe_from_changes(uint64_t subscription) const {
+    _change_feed.unsubscribe(subscription);
+}
+
+void
+database::apply_changeset(const string &changeset, changeset_conflict on_conflict) const {
+    get_session_impl()->with_writer([&](connection &conn) {
+        quince_sqlite::apply_changeset(conn.handle(), changeset, on_conflict);
+    });
+}
+
+vector<query_plan_finding>
+database::get_query_plan_findings() const {
+    if (! _query_plan_advisor)  return vector<query_plan_finding>();
+    return _query_plan_advisor->get_findings();
+}
+
+void
+database::reset_query_plan_findings() const {
+    if (_query_plan_advisor)  _query_plan_advisor->clear();
+}
+
 unique_ptr<sql>
 database::make_sql() const {
     return make_dialect_sql();
@@ -137,41 +349,147 @@ database::get_default_enclosure() const {
     return boost::none;
 }
 
+// Nothing is attached here: each connection attaches the enclosure when a statement first
+// refers to it (see enclosures_used_by()), so that only the connections that use it pay.
+//
 void
 database::make_enclosure_available(const optional<string> &enclosure_name) const {
     if (enclosure_name) {
-        path absolute;
-        if (const optional<const path &> found = lookup(_attachable_database_absolute_filenames, *enclosure_name))
-            absolute = std::move(*found);
-        else
-            absolute = boost::filesystem::absolute(path(*enclosure_name));
+        const optional<const connection_tuning &> tuning = lookup(_spec._settings._enclosure_tuning, *enclosure_name);
+        const attachment a = {
+            *enclosure_name,
+            enclosure_filename(*enclosure_name).string(),
+            tuning ? *tuning : _spec._settings._tuning
+        };
+        const std::lock_guard<std::mutex> lock(_available_enclosures_mutex);
+        _available_enclosures.emplace(*enclosure_name, a);
+        _available_enclosure_count = _available_enclosures.size();
+    }
+}
 
-        const unique_ptr<dialect_sql> cmd = make_dialect_sql();
-        cmd->write_attach_database(absolute, *enclosure_name);
-        get_session()->exec(*cmd);
+shared_ptr<connection>
+database::checkout_connection(const optional<string> &enclosure, bool writable) const {
+    const shared_ptr<connection> result = get_session_impl()->checkout(writable);
+    if (enclosure) {
+        const std::lock_guard<std::mutex> lock(_available_enclosures_mutex);
+        const auto found = _available_enclosures.find(*enclosure);
+        if (found != _available_enclosures.end())  result->attach({ found->second });
     }
+    return result;
+}
+
+// quince refers to a table in an enclosure as "enclosure"."table", so we look at every quoted
+// identifier that is followed by a dot.  Most of them are table aliases, which we won't find.
+//
+vector<attachment>
+database::enclosures_used_by(const string &sql_text) const {
+    vector<attachment> result;
+    if (_available_enclosure_count == 0)  return result;
+
+    const std::lock_guard<std::mutex> lock(_available_enclosures_mutex);
+    size_t pos = 0;
+    while (pos < sql_text.size()) {
+        const char c = sql_text[pos];
+        if (c != '"'  &&  c != '\'') {
+            pos++;
+            continue;
+        }
+        const size_t closing = sql_text.find(c, pos+1);
+        if (closing == string::npos)  break;
+        if (c == '"'  &&  closing + 1 < sql_text.size()  &&  sql_text[closing+1] == '.') {
+            const auto found = _available_enclosures.find(sql_text.substr(pos+1, closing-pos-1));
+            if (found != _available_enclosures.end()) {
+                const bool already = std::any_of(result.begin(), result.end(), [&](const attachment &a) {
+                    return a._name == found->first;
+                });
+                if (! already)  result.push_back(found->second);
+            }
+        }
+        pos = closing + 1;
+    }
+    return result;
 }
 
 new_session
 database::make_session() const {
-    return quince::make_unique<session_impl>(*this, _spec);
+    return quince::make_unique<session_impl>(*this, _spec, _pool.get());
 }
 
+// quince checks every table's columns when it opens the table, so with many tables it pays
+// to fetch them all at once, and then answer from the cache until the schema changes.
+// Checking schema_version costs one single-row query per call.
+//
 vector<string>
 database::retrieve_column_titles(const binomen &table) const {
-    const session s = get_session();
+    if (! sqlite_version_at_least(3016000)) {
+        const session s = get_session();
 
+        const unique_ptr<dialect_sql> cmd = make_dialect_sql();
+        cmd->write_retrieve_metadata(table);
+        const result_stream stream = s->exec_with_stream_output(*cmd, 1);
+
+        vector<string> result;
+        while (unique_ptr<row> r = s->next_output(stream)) {
+            string name;
+            r->get("name", name);
+            string type;
+            r->get("type", type);
+            result.push_back("\"" + name + "\" " + type);
+        }
+        return result;
+    }
+
+    const string key = table._enclosure ? *table._enclosure : string();
+    const int64_t schema_version = retrieve_schema_version(table._enclosure);
+    {
+        const std::lock_guard<std::mutex> lock(_metadata_cache_mutex);
+        const auto found = _metadata_cache.find(key);
+        if (found != _metadata_cache.end()  &&  found->second._schema_version == schema_version) {
+            const auto columns = found->second._column_titles.find(table._local);
+            return columns == found->second._column_titles.end() ? vector<string>() : columns->second;
+        }
+    }
+
+    schema_metadata fresh = retrieve_all_metadata(table._enclosure, schema_version);
+    const auto columns = fresh._column_titles.find(table._local);
+    vector<string> result = columns == fresh._column_titles.end() ? vector<string>() : columns->second;
+
+    const std::lock_guard<std::mutex> lock(_metadata_cache_mutex);
+    _metadata_cache[key] = std::move(fresh);
+    return result;
+}
+
+int64_t
+database::retrieve_schema_version(const optional<string> &enclosure) const {
     const unique_ptr<dialect_sql> cmd = make_dialect_sql();
-    cmd->write_retrieve_metadata(table);
-    const result_stream stream = s->exec_with_stream_output(*cmd, 1);
+    cmd->write_retrieve_schema_version(enclosure);
+    const unique_ptr<row> r = get_session()->exec_with_one_output(*cmd);
+
+    int64_t result = 0;
+    if (r)  r->get("schema_version", result);
+    return result;
+}
 
-    vector<string> result;
+// schema_version must be read before the metadata, so that if the schema changes in between,
+// the cache entry will look stale at the next call, and be refreshed then.
+//
+database::schema_metadata
+database::retrieve_all_metadata(const optional<string> &enclosure, int64_t schema_version) const {
+    schema_metadata result;
+    result._schema_version = schema_version;
+
+    const session s = get_session();
+    const unique_ptr<dialect_sql> cmd = make_dialect_sql();
+    cmd->write_retrieve_all_metadata(enclosure);
+    const result_stream stream = s->exec_with_stream_output(*cmd, 256);
     while (unique_ptr<row> r = s->next_output(stream)) {
+        string table_name;
+        r->get("table_name", table_name);
         string name;
         r->get("name", name);
         string type;
         r->get("type", type);
-        result.push_back("\"" + name + "\" " + type);
+        result._column_titles[table_name].push_back("\"" + name + "\" " + type);
     }
     return result;
 }
@@ -201,35 +519,101 @@ database::supports_join(conditional_junction_type type) const {
         case conditional_junction_type::inner:
         case conditional_junction_type::left:   return true;
         case conditional_junction_type::right:
-        case conditional_junction_type::full:   return false;
+        case conditional_junction_type::full:   return sqlite_version_at_least(3039000);
         default:                                abort();
     }
 }
 
+// An index key can't have an expression that needs a bound parameter, and the quickest way
+// to find out is to write it.
+//
 bool
-database::supports_combination(combination_type type, bool all) const {
-    return !all || type == combination_type::union_;
+database::supports_index(const index_spec &spec) const {
+    try {
+        make_dialect_sql()->write_index_key(spec._mappers);
+        return true;
+    }
+    catch (const unsupported_exception &) {
+        return false;
+    }
 }
 
 bool
-database::supports_index(const index_spec &spec) const {
-    for (const abstract_mapper_base *m: spec._mappers)
-        if (dynamic_cast<const exprn_mapper_base *>(m))
-            return false;
-    return true;
+database::supports_combination(combination_type type, bool all) const {
+    return !all || type == combination_type::union_;
 }
 
-
 shared_ptr<session_impl>
 database::get_session_impl() const {
     return dynamic_pointer_cast<session_impl>(get_session());
 }
 
+unique_ptr<connection>
+database::open_side_connection(const optional<string> &enclosure) const {
+    connection_spec spec = _spec;
+    spec._flags = (_spec._flags & ~SQLITE_OPEN_SHAREDCACHE) | SQLITE_OPEN_PRIVATECACHE;
+    spec._change_feed = nullptr;
+    auto result = quince::make_unique<connection>(spec);
+    if (enclosure) {
+        const unique_ptr<dialect_sql> cmd = make_dialect_sql();
+        cmd->write_attach_database(enclosure_filename(*enclosure), *enclosure);
+        result->exec(cmd->get_text());
+    }
+    return result;
+}
+
+path
+database::enclosure_filename(const string &enclosure_name) const {
+    if (const optional<const path &> found = lookup(_attachable_database_absolute_filenames, enclosure_name))
+        return *found;
+    return boost::filesystem::absolute(path(enclosure_name));
+}
+
+// One UPDATE, whose cost is linear in the size of the table, however many distinct values the
+// column has.
+//
+uint64_t
+database::convert_ptime_column_to_integer(const binomen &table, const string &column) const {
+    const unique_ptr<dialect_sql> cmd = make_dialect_sql();
+    cmd->write_convert_text_column(table, column, ptime_text_to_microseconds_name);
+
+    uint64_t result = 0;
+    get_session_impl()->with_writer([&](connection &conn) {
+        sqlite3 * const handle = conn.handle();
+        if (sqlite3_create_function_v2(
+            handle, ptime_text_to_microseconds_name, 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+            nullptr, ptime_text_to_microseconds, nullptr, nullptr, nullptr
+        ) != SQLITE_OK)
+            throw dbms_exception(sqlite3_errmsg(handle));
+
+        sqlite3_stmt *stmt = nullptr;
+        if (sqlite3_prepare_v2(handle, cmd->get_text().c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+            throw dbms_exception(sqlite3_errmsg(handle));
+        const finalizing_stmt finalizer(stmt);
+        if (conn.step(stmt, 0) != SQLITE_DONE)  throw dbms_exception(sqlite3_errmsg(handle));
+        result = uint64_t(sqlite3_changes(handle));
+    });
+    return result;
+}
+
 unique_ptr<dialect_sql>
 database::make_dialect_sql() const {
     return quince::make_unique<dialect_sql>(*this);
 }
 
+void
+database::post(std::function<void()> &&job) const {
+    if (_executors.empty())
+        job();
+    else
+        _executors[_next_executor++ % _executors.size()]->post(std::move(job));
+}
+
+void
+database::note_activity() const {
+    if (_checkpointer)  _checkpointer->note_activity();
+}
+
 }
 
 QUINCE_UNSUPPRESS_MSVC_WARNING
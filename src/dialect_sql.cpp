@@ -3,12 +3,18 @@
 //    (See accompanying file ../LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <boost/algorithm/string/replace.hpp>
 #include <quince/detail/binomen.h>
 #include <quince/detail/util.h>
 #include <quince/mappers/detail/persistent_column_mapper.h>
 #include <quince/exprn_mappers/detail/exprn_mapper.h>
 #include <quince/query.h>
 #include <quince_sqlite/database.h>
+#include <quince_sqlite/detail/connection.h>
 #include <quince_sqlite/detail/dialect_sql.h>
 
 using namespace quince;
@@ -21,6 +27,139 @@ using std::vector;
 
 namespace quince_sqlite {
 
+namespace {
+    const string distinct_on_opening = "/*quince_sqlite:distinct_on(";
+    const string distinct_on_closing = ")*/ ";
+
+    bool
+    is_word_char(char c) {
+        return isalnum(static_cast<unsigned char>(c))  ||  c == '_'  ||  c == '$';
+    }
+
+    // Where the token that begins at pos ends.  A token is a quoted string or identifier
+    // (which may contain doubled quotes), a comment, a run of whitespace, a word, or any
+    // other single character.
+    //
+    size_t
+    token_end(const string &text, size_t pos) {
+        const char c = text[pos];
+        if (c == '\''  ||  c == '"'  ||  c == '`'  ||  c == '[') {
+            const char closing = c == '[' ? ']' : c;
+            size_t end = pos;
+            do {
+                end = text.find(closing, end+1);
+                if (end == string::npos)  return text.size();
+            } while (closing != ']'  &&  ++end < text.size()  &&  text[end] == closing);
+            return closing == ']' ? end + 1 : end;
+        }
+        if (text.compare(pos, 2, "/*") == 0) {
+            const size_t closing = text.find("*/", pos+2);
+            return closing == string::npos ? text.size() : closing + 2;
+        }
+        if (text.compare(pos, 2, "--") == 0) {
+            const size_t closing = text.find('\n', pos+2);
+            return closing == string::npos ? text.size() : closing + 1;
+        }
+        size_t end = pos + 1;
+        if (isspace(static_cast<unsigned char>(c)))
+            while (end < text.size()  &&  isspace(static_cast<unsigned char>(text[end])))  end++;
+        else if (is_word_char(c))
+            while (end < text.size()  &&  is_word_char(text[end]))  end++;
+        return end;
+    }
+
+    bool
+    is_keyword(const string &text, size_t begin, size_t end, const char *keyword) {
+        if (end - begin != strlen(keyword))  return false;
+        for (size_t i = 0; i < end - begin; i++)
+            if (toupper(static_cast<unsigned char>(text[begin + i])) != keyword[i])  return false;
+        return true;
+    }
+
+    string
+    trimmed(const string &text, size_t begin, size_t end) {
+        while (begin < end  &&  isspace(static_cast<unsigned char>(text[begin])))  begin++;
+        while (end > begin  &&  isspace(static_cast<unsigned char>(text[end-1])))  end--;
+        return text.substr(begin, end - begin);
+    }
+
+    // Where the clauses of a SELECT begin, looking only at its own level: not inside
+    // parentheses, quotes or comments.  _end is where the SELECT itself ends, i.e. at the
+    // parenthesis that encloses it, a set operator, or the end of the text.  _item_ends are
+    // where the items of its select list end, i.e. at each comma and at the FROM.
+    //
+    struct select_clauses {
+        size_t _from = string::npos;
+        size_t _order_by = string::npos;
+        size_t _order_by_end = string::npos;    // just after the BY
+        size_t _limit = string::npos;
+        size_t _end = string::npos;
+        vector<size_t> _item_ends;
+    };
+
+    select_clauses
+    find_clauses(const string &text, size_t begin) {
+        select_clauses result;
+        int depth = 0;
+        size_t pending_order = string::npos;    // an ORDER that is waiting for its BY
+        size_t pos = begin;
+        while (pos < text.size()) {
+            const size_t end = token_end(text, pos);
+            const char c = text[pos];
+            if (c == '(')  depth++;
+            else if (c == ')'  &&  depth-- == 0)  break;
+            else if (depth == 0  &&  is_word_char(c)) {
+                if (   is_keyword(text, pos, end, "UNION")
+                    || is_keyword(text, pos, end, "INTERSECT")
+                    || is_keyword(text, pos, end, "EXCEPT"))
+                    break;
+                if (result._from == string::npos) {
+                    if (is_keyword(text, pos, end, "FROM")) {
+                        result._from = pos;
+                        result._item_ends.push_back(pos);
+                    }
+                }
+                else if (pending_order != string::npos  &&  is_keyword(text, pos, end, "BY")) {
+                    result._order_by = pending_order;
+                    result._order_by_end = end;
+                }
+                else if (is_keyword(text, pos, end, "LIMIT"))
+                    result._limit = pos;
+                pending_order = is_keyword(text, pos, end, "ORDER") ? pos : string::npos;
+            }
+            else if (depth == 0  &&  c == ','  &&  result._from == string::npos)
+                result._item_ends.push_back(pos);
+            if (! isspace(static_cast<unsigned char>(c))  &&  ! is_word_char(c))  pending_order = string::npos;
+            pos = end;
+        }
+        result._end = pos;
+        return result;
+    }
+
+    // The name under which the select list item text[begin, end) appears in the output, as
+    // SQL, if it is one that we can tell: i.e. the item ends with an alias or a column name.
+    //
+    optional<string>
+    output_name(const string &text, size_t begin, size_t end) {
+        vector<std::pair<size_t, size_t>> tokens;
+        for (size_t pos = begin; pos < end; pos = token_end(text, pos))
+            if (! isspace(static_cast<unsigned char>(text[pos])))
+                tokens.emplace_back(pos, token_end(text, pos));
+        if (tokens.empty())  return boost::none;
+
+        const auto last = tokens.back();
+        const char c = text[last.first];
+        if (c != '"'  &&  ! (is_word_char(c)  &&  ! isdigit(static_cast<unsigned char>(c))))  return boost::none;
+        if (tokens.size() > 1) {
+            const auto before = tokens[tokens.size() - 2];
+            if (! is_keyword(text, before.first, before.second, "AS")  &&  text[before.first] != '.')
+                return boost::none;
+        }
+        return text.substr(last.first, last.second - last.first);
+    }
+}
+
+
 dialect_sql::dialect_sql(const database &db) :
     sql(db),
     _next_placeholder_serial(0)
@@ -54,6 +193,55 @@ dialect_sql::write_retrieve_metadata(const binomen &table) {
     write("table_info(" + table._local + ")");
 }
 
+void
+dialect_sql::write_retrieve_schema_version(const optional<string> &enclosure) {
+    write("PRAGMA ");
+    if (enclosure) {
+        write_quoted(*enclosure);
+        write(".");
+    }
+    write("schema_version");
+}
+
+// The columns of every table in one go, in the same form as write_retrieve_metadata(), plus
+// the table's name.  pragma_table_info() needs SQLite 3.16.
+//
+void
+dialect_sql::write_retrieve_all_metadata(const optional<string> &enclosure) {
+    const string schema = enclosure ? *enclosure : "main";
+    write("SELECT m.name AS table_name, p.name AS name, p.type AS type FROM ");
+    write_quoted(schema);
+    write(".sqlite_master AS m JOIN pragma_table_info(m.name, ");
+    write("'" + boost::replace_all_copy(schema, "'", "''") + "'");
+    write(") AS p WHERE m.type = 'table' ORDER BY m.name, p.cid");
+}
+
+// Sets column to function(column) wherever it is currently TEXT.
+//
+void
+dialect_sql::write_convert_text_column(const binomen &table, const string &column, const string &function) {
+    write("UPDATE ");
+    write_quoted(table);
+    write(" SET ");
+    write_quoted(column);
+    write(" = " + function + "(");
+    write_quoted(column);
+    write(") WHERE typeof(");
+    write_quoted(column);
+    write(") = 'text'");
+}
+
+// Sets column to ?1 zero bytes in the record whose rowid is ?2.
+//
+void
+dialect_sql::write_preallocate_blob(const binomen &table, const string &column) {
+    write("UPDATE ");
+    write_quoted(table);
+    write(" SET ");
+    write_quoted(column);
+    write(" = zeroblob(?1) WHERE rowid = ?2");
+}
+
 void
 dialect_sql::write_create_index(
     const binomen &table,
@@ -70,15 +258,59 @@ dialect_sql::write_create_index(
     write_quoted(index_name);
     write (" ON ");
     write_quoted(table._local);
+    write_index_key(mappers);
+}
+
+void
+dialect_sql::write_create_partial_index(
+    const binomen &table,
+    const string &index_name,
+    const vector<const abstract_mapper_base *> &mappers,
+    const abstract_predicate &predicate,
+    bool unique
+) {
+    binomen qualified_index_name = table;
+    qualified_index_name._local = index_name;
+
+    write("CREATE ");
+    if (unique)  write("UNIQUE ");
+    write("INDEX IF NOT EXISTS ");
+    write_quoted(qualified_index_name);
+    write (" ON ");
+    write_quoted(table._local);
+    write_index_key(mappers);
+
+    const uint32_t placeholders_before = _next_placeholder_serial;
+    write(" WHERE ");
+    write_evaluation(predicate);
+    if (_next_placeholder_serial != placeholders_before)  throw unsupported_exception();
+}
+
+// SQLite doesn't allow bound parameters in an index, so an expression that needs one (i.e.
+// that has a constant in it) is rejected here rather than by sqlite3_prepare_v2().  The
+// same goes for a partial index's predicate.
+//
+void
+dialect_sql::write_index_key(const vector<const abstract_mapper_base *> &mappers) {
+    const uint32_t placeholders_before = _next_placeholder_serial;
 
     write(" (");
     comma_separated_list_scope list_scope(*this);
     for (const abstract_mapper_base *m: mappers)
-        m->for_each_persistent_column([&](const persistent_column_mapper &p) {
+        if (dynamic_cast<const exprn_mapper_base *>(m)) {
             list_scope.start_item();
-            write_quoted(p.name());
-        });
+            write("(");
+            write_evaluation(*m);
+            write(")");
+        }
+        else
+            m->for_each_persistent_column([&](const persistent_column_mapper &p) {
+                list_scope.start_item();
+                write_quoted(p.name());
+            });
     write(")");
+
+    if (_next_placeholder_serial != placeholders_before)  throw unsupported_exception();
 }
 
 void
@@ -93,25 +325,133 @@ dialect_sql::write_create_table(
     if (! generated_key)  write(" WITHOUT ROWID");
 }
 
+// Row values, e.g. (a, b) > (?1, ?2), arrived in SQLite 3.15.  The planner can use an index
+// on (a, b) to seek straight to the first qualifying row, which makes this the way to do
+// keyset pagination over a composite key.
+//
 void
 dialect_sql::write_collective_comparison(relation r, const abstract_column_sequence &lhs, const collective_base &rhs) {
-    throw unsupported_exception();
+    if (! sqlite_version_at_least(3015000))  throw unsupported_exception();
+
+    sql::write_collective_comparison(r, lhs, rhs);
 }
 
+// SQLite has no DISTINCT ON, so we leave a marker in its place, with the distinct
+// expressions inside it, and note where it is, so that expanded_text() can do the rest
+// once the SELECT is complete.
+//
 void
 dialect_sql::write_distinct(const vector<const abstract_mapper_base *> &distincts) {
-    if (! distincts.empty())  throw unsupported_exception();
+    if (distincts.empty())
+        write_distinct();
+    else {
+        if (! sqlite_version_at_least(3025000))  throw unsupported_exception();  // no window functions
 
-    write_distinct();
+        distinct_on d;
+        d._marker = get_text().size();
+        write(distinct_on_opening);
+        d._partition_begin = get_text().size();
+        {
+            comma_separated_list_scope list_scope(*this);
+            for (const abstract_mapper_base *m: distincts) {
+                list_scope.start_item();
+                write_evaluation(*m);
+            }
+        }
+        d._partition_end = get_text().size();
+        write(distinct_on_closing);
+        d._list_begin = get_text().size();
+        _distinct_ons.push_back(d);
+    }
 }
 
+// SQLite has no INTERSECT ALL or EXCEPT ALL.  Nor does it accept a parenthesized SELECT as
+// an operand of UNION etc., so a nested combination on the rhs is written as a subquery.
+//
 void
 dialect_sql::write_combination(combination_type type, bool all, const query_base &rhs) {
     if (all  &&  type != combination_type::union_)  throw unsupported_exception();
 
-    if (rhs.is_combined())  throw unsupported_exception();
+    if (! rhs.is_combined()) {
+        sql::write_combination(type, all, rhs);
+        return;
+    }
+
+    switch (type) {
+        case combination_type::union_:      write(" UNION ");       break;
+        case combination_type::intersect:   write(" INTERSECT ");   break;
+        case combination_type::except:      write(" EXCEPT ");      break;
+        default:                            abort();
+    }
+    if (all)  write("ALL ");
+    write("SELECT * FROM (");
+    write_select(rhs);
+    write(")");
+}
 
-    sql::write_combination(type, all, rhs);
+// Turns each
+//
+//      SELECT <marker for d1, d2> <list> FROM <rest> ORDER BY <order> LIMIT <limit>
+//
+// into
+//
+//      SELECT <names> FROM (
+//          SELECT <list>,
+//              ROW_NUMBER() OVER (PARTITION BY d1, d2 ORDER BY <order>) AS "quince_sqlite$rank",
+//              ROW_NUMBER() OVER (ORDER BY <order>) AS "quince_sqlite$order"
+//          FROM <rest>
+//      ) WHERE "quince_sqlite$rank" = 1 ORDER BY "quince_sqlite$order" LIMIT <limit>
+//
+// so that only the first row of each group leaves SQLite.  <names> are the output names of
+// the items in <list>, so the two extra columns stay inside.  (If an item has no name that we
+// can tell, <names> is *, and the extra columns come out too.)  Placeholders are numbered, so
+// it doesn't matter that some move.
+//
+// A SELECT that is nested in another comes later in the text than the other's marker, so
+// we work backwards, and each expansion leaves the offsets of the markers before it intact.
+//
+string
+dialect_sql::expanded_text() const {
+    if (_distinct_ons.empty())  return get_text();
+
+    string text = get_text();
+    for (auto d = _distinct_ons.rbegin(); d != _distinct_ons.rend(); ++d) {
+        const select_clauses clauses = find_clauses(text, d->_list_begin);
+        if (clauses._from == string::npos)  throw unsupported_exception();
+
+        const size_t rest_end = std::min({ clauses._order_by, clauses._limit, clauses._end });
+        const size_t order_end = std::min(clauses._limit, clauses._end);
+        const string order =
+            clauses._order_by == string::npos
+                ? string()
+                : trimmed(text, clauses._order_by_end, order_end);
+
+        string names;
+        size_t item_begin = d->_list_begin;
+        for (const size_t item_end: clauses._item_ends) {
+            const optional<string> name = output_name(text, item_begin, item_end);
+            if (! name) {
+                names = "*";
+                break;
+            }
+            if (! names.empty())  names += ", ";
+            names += *name;
+            item_begin = item_end + 1;
+        }
+
+        string expansion = names + " FROM (SELECT " + trimmed(text, d->_list_begin, clauses._from);
+        expansion += ", ROW_NUMBER() OVER (PARTITION BY " + text.substr(d->_partition_begin, d->_partition_end - d->_partition_begin);
+        if (! order.empty())  expansion += " ORDER BY " + order;
+        expansion += ") AS \"quince_sqlite$rank\"";
+        if (! order.empty())  expansion += ", ROW_NUMBER() OVER (ORDER BY " + order + ") AS \"quince_sqlite$order\"";
+        expansion += " " + trimmed(text, clauses._from, rest_end);
+        expansion += ") WHERE \"quince_sqlite$rank\" = 1 ";
+        if (! order.empty())  expansion += "ORDER BY \"quince_sqlite$order\" ";
+        if (clauses._limit != string::npos)  expansion += trimmed(text, clauses._limit, clauses._end) + " ";
+
+        text.replace(d->_marker, clauses._end - d->_marker, expansion);
+    }
+    return text;
 }
 
 string
@@ -0,0 +1,106 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <quince_sqlite/detail/executor.h>
+
+using std::function;
+
+
+namespace quince_sqlite {
+
+job_queue::job_queue() :
+    _head(new node()),
+    _tail(_head.load())
+{
+    _tail->_next = nullptr;
+}
+
+job_queue::~job_queue() {
+    function<void()> discarded;
+    while (try_pop(discarded)) {}
+    delete _tail;
+}
+
+void
+job_queue::push(function<void()> &&job) {
+    node * const n = new node();
+    n->_next = nullptr;
+    n->_job = std::move(job);
+    node * const previous = _head.exchange(n);
+    previous->_next = n;
+}
+
+bool
+job_queue::try_pop(function<void()> &job) {
+    node * const next = _tail->_next;
+    if (next == nullptr)  return false;
+
+    job = std::move(next->_job);
+    delete _tail;
+    _tail = next;
+    return true;
+}
+
+bool
+job_queue::empty() const {
+    return _tail->_next == nullptr;
+}
+
+
+executor::executor() :
+    _sleeping(false),
+    _woken(false),
+    _stopping(false),
+    _thread([this] { run(); })
+{}
+
+executor::~executor() {
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+        _woken = true;
+    }
+    _wake.notify_one();
+    _thread.join();
+}
+
+// The push must be complete before we look at _sleeping, and run() must set _sleeping before
+// it takes its last look at the queue, so that (with the default, sequentially consistent
+// ordering) one of us always sees the other.  Posters only touch the mutex when the executor
+// has gone to sleep.
+//
+void
+executor::post(function<void()> &&job) {
+    _jobs.push(std::move(job));
+    if (_sleeping) {
+        {
+            const std::lock_guard<std::mutex> lock(_mutex);
+            _woken = true;
+        }
+        _wake.notify_one();
+    }
+}
+
+void
+executor::run() {
+    function<void()> job;
+    for (;;) {
+        while (_jobs.try_pop(job)) {
+            job();
+            job = nullptr;
+        }
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _sleeping = true;
+        if (_jobs.empty()) {
+            if (_stopping)  return;
+            _wake.wait(lock, [this] { return _woken; });
+        }
+        _woken = false;
+        _sleeping = false;
+    }
+}
+
+}
@@ -0,0 +1,84 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <algorithm>
+#include <quince_sqlite/detail/histogram.h>
+
+
+namespace quince_sqlite {
+
+namespace {
+    size_t
+    bucket_for(uint64_t sample) {
+        size_t result = 0;
+        while (sample != 0  &&  result < histogram::bucket_count - 1) {
+            sample >>= 1;
+            result++;
+        }
+        return result;
+    }
+
+    uint64_t
+    upper_bound(size_t bucket) {
+        return bucket == 0 ? 0 : (uint64_t(1) << bucket) - 1;
+    }
+}
+
+
+histogram::histogram() :
+    _count(0),
+    _total(0),
+    _max(0)
+{
+    _buckets.fill(0);
+}
+
+void
+histogram::record(uint64_t sample) {
+    _buckets[bucket_for(sample)]++;
+    _count++;
+    _total += sample;
+    _max = std::max(_max, sample);
+}
+
+histogram &
+histogram::operator+=(const histogram &other) {
+    for (size_t i = 0; i < bucket_count; i++)
+        _buckets[i] += other._buckets[i];
+    _count += other._count;
+    _total += other._total;
+    _max = std::max(_max, other._max);
+    return *this;
+}
+
+uint64_t
+histogram::percentile(double fraction) const {
+    const uint64_t wanted = uint64_t(fraction * double(_count) + 0.5);
+    uint64_t so_far = 0;
+    for (size_t i = 0; i < bucket_count; i++)
+        if ((so_far += _buckets[i]) >= wanted  &&  so_far > 0)
+            return std::min(upper_bound(i), _max);
+    return _max;
+}
+
+void
+histogram::write_json(std::ostream &os) const {
+    os << "{\"count\":" << _count
+       << ",\"total\":" << _total
+       << ",\"max\":" << _max
+       << ",\"p50\":" << percentile(0.5)
+       << ",\"p90\":" << percentile(0.9)
+       << ",\"p99\":" << percentile(0.99)
+       << ",\"buckets\":{";
+    const char *separator = "";
+    for (size_t i = 0; i < bucket_count; i++)
+        if (_buckets[i] != 0) {
+            os << separator << '"' << upper_bound(i) << "\":" << _buckets[i];
+            separator = ",";
+        }
+    os << "}}";
+}
+
+}
@@ -0,0 +1,102 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <atomic>
+#include <fstream>
+#include <boost/filesystem/operations.hpp>
+#include <quince/exceptions.h>
+#include <quince/detail/util.h>
+#include <sqlite3.h>
+#include <quince_sqlite/detail/backup.h>
+#include <quince_sqlite/detail/image.h>
+
+using namespace quince;
+using std::string;
+using std::unique_ptr;
+
+
+namespace quince_sqlite {
+
+namespace {
+    // Bytes 18 and 19 of the database header are the file format's write and read versions,
+    // which are 2 for a WAL database.  An in-memory database can't be in WAL mode, so loading
+    // an image that says it is fails (with SQLITE_CANTOPEN, when the backup into the memdb
+    // starts).  The image always holds every committed page, so it is just as good as a
+    // rollback-journal database, which says 1.
+    //
+    void
+    mark_as_rollback_journal(unsigned char *data, size_t size) {
+        if (size < 20)  return;
+        if (data[18] == 2)  data[18] = 1;
+        if (data[19] == 2)  data[19] = 1;
+    }
+}
+
+
+string
+new_memdb_uri() {
+    static std::atomic<uint64_t> serial(0);
+    return "file:/quince_sqlite_image_" + std::to_string(++serial) + "?vfs=memdb";
+}
+
+// sqlite3_deserialize() always gives its connection a private database, so the image is
+// deserialized into a staging connection, and then copied into the shared one.  The buffer
+// must come from sqlite3_malloc64(), so that SQLite can free it along with the staging
+// connection (or at once, if sqlite3_deserialize() fails).
+//
+unique_ptr<connection>
+load_image(const string &image_filename, const string &memdb_uri) {
+    boost::system::error_code error;
+    const boost::uintmax_t size = boost::filesystem::file_size(image_filename, error);
+    std::ifstream in(image_filename, std::ios::binary);
+    if (error  ||  ! in)  throw failed_connection_exception();
+
+    const auto data = static_cast<unsigned char *>(sqlite3_malloc64(size));
+    if (data == nullptr  &&  size != 0)  throw dbms_exception("out of memory (loading " + image_filename + ")");
+    if (! in.read(reinterpret_cast<char *>(data), std::streamsize(size))) {
+        sqlite3_free(data);
+        throw dbms_exception("couldn't read " + image_filename);
+    }
+    mark_as_rollback_journal(data, size_t(size));   // in case it was written by something else
+
+    const auto spec = [](const string &filename, int flags) {
+        return connection_spec { filename, flags, boost::none, settings(), nullptr, nullptr };
+    };
+    connection staging(spec(":memory:", SQLITE_OPEN_READWRITE | SQLITE_OPEN_PRIVATECACHE));
+    const int result_code = sqlite3_deserialize(
+        staging.handle(),
+        "main",
+        data,
+        sqlite3_int64(size),
+        sqlite3_int64(size),
+        SQLITE_DESERIALIZE_FREEONCLOSE
+    );
+    if (result_code != SQLITE_OK)
+        throw dbms_exception(string(sqlite3_errmsg(staging.handle())) + " (loading " + image_filename + ")");
+
+    auto result = quince::make_unique<connection>(
+        spec(memdb_uri, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI | SQLITE_OPEN_FULLMUTEX)
+    );
+    backup_options all_at_once;
+    all_at_once._pages_per_step = -1;
+    all_at_once._pause = std::chrono::milliseconds(0);
+    run_backup(staging.handle(), "main", result->handle(), all_at_once);
+    return result;
+}
+
+void
+save_image(sqlite3 *conn, const string &schema, const string &image_filename) {
+    sqlite3_int64 size = 0;
+    unsigned char * const data = sqlite3_serialize(conn, schema.c_str(), &size, 0);
+    if (data == nullptr)  throw dbms_exception(string(sqlite3_errmsg(conn)) + " (serializing " + schema + ")");
+    mark_as_rollback_journal(data, size_t(size));
+
+    std::ofstream out(image_filename, std::ios::binary | std::ios::trunc);
+    const bool written = out.write(reinterpret_cast<const char *>(data), std::streamsize(size)).flush().good();
+    sqlite3_free(data);
+    if (! written)  throw dbms_exception("couldn't write " + image_filename);
+}
+
+}
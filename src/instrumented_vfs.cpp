@@ -0,0 +1,548 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+#include <quince/exceptions.h>
+#include <quince/detail/util.h>
+#include <sqlite3.h>
+#include <quince_sqlite/detail/instrumented_vfs.h>
+
+using boost::optional;
+using namespace quince;
+using std::map;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+#ifndef SQLITE_OPEN_SUPER_JOURNAL
+#define SQLITE_OPEN_SUPER_JOURNAL SQLITE_OPEN_MASTER_JOURNAL    // its name before SQLite 3.33
+#endif
+
+
+namespace quince_sqlite {
+
+namespace {
+    typedef std::chrono::steady_clock clock;
+
+    uint64_t
+    microseconds_since(clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count();
+    }
+
+    file_kind
+    kind_for(int open_flags) {
+        if (open_flags & SQLITE_OPEN_MAIN_DB)       return file_kind::main_db;
+        if (open_flags & SQLITE_OPEN_MAIN_JOURNAL)  return file_kind::main_journal;
+        if (open_flags & SQLITE_OPEN_WAL)           return file_kind::wal;
+        if (open_flags & SQLITE_OPEN_TEMP_DB)       return file_kind::temp_db;
+        if (open_flags & SQLITE_OPEN_TEMP_JOURNAL)  return file_kind::temp_journal;
+        if (open_flags & SQLITE_OPEN_SUBJOURNAL)    return file_kind::subjournal;
+        if (open_flags & SQLITE_OPEN_SUPER_JOURNAL) return file_kind::super_journal;
+        return file_kind::other;
+    }
+
+    const char *
+    name_of(file_kind kind) {
+        switch (kind) {
+            case file_kind::main_db:        return "main db";
+            case file_kind::main_journal:   return "main journal";
+            case file_kind::wal:            return "wal";
+            case file_kind::temp_db:        return "temp db";
+            case file_kind::temp_journal:   return "temp journal";
+            case file_kind::subjournal:     return "subjournal";
+            case file_kind::super_journal:  return "super journal";
+            default:                        return "other";
+        }
+    }
+
+    struct file_entry {
+        std::mutex _mutex;
+        file_io_statistics _statistics;
+    };
+
+    // Entries are never removed, so a file may keep a pointer to its entry for as long as
+    // it is open.
+    //
+    struct statistics_registry {
+        std::mutex _mutex;
+        map<string, unique_ptr<file_entry>> _entries;
+
+        file_entry &
+        entry_for(const string &key, file_kind kind) {
+            const std::lock_guard<std::mutex> lock(_mutex);
+            unique_ptr<file_entry> &result = _entries[key];
+            if (! result) {
+                result = quince::make_unique<file_entry>();
+                result->_statistics = file_io_statistics();
+                result->_statistics._kind = kind;
+            }
+            return *result;
+        }
+    };
+
+    statistics_registry &
+    registry() {
+        static statistics_registry result;
+        return result;
+    }
+
+
+    struct shim {
+        sqlite3_vfs _vfs;
+        sqlite3_vfs *_underlying;
+        size_t _read_ahead_bytes;
+        string _name;
+    };
+
+    shim &
+    shim_of(sqlite3_vfs *vfs) {
+        return *static_cast<shim *>(vfs->pAppData);
+    }
+
+    // What SQLite allocates for each file we open: our state first, and then the underlying
+    // VFS's file, at an offset that keeps it aligned.
+    //
+    struct instrumented_file {
+        sqlite3_file _base;         // must come first
+        file_entry *_entry;
+        size_t _read_ahead_bytes;
+        sqlite3_int64 _next_sequential_offset;
+        vector<char> _buffer;
+        sqlite3_int64 _buffer_offset;
+        size_t _buffer_size;
+
+        static size_t
+        underlying_offset() {
+            const size_t alignment = alignof(std::max_align_t);
+            return (sizeof(instrumented_file) + alignment - 1) / alignment * alignment;
+        }
+
+        sqlite3_file *
+        underlying() {
+            return reinterpret_cast<sqlite3_file *>(reinterpret_cast<char *>(this) + underlying_offset());
+        }
+
+        const sqlite3_io_methods &
+        methods() {
+            return *underlying()->pMethods;
+        }
+
+        void
+        drop_buffer() {
+            _buffer_size = 0;
+        }
+
+        template<typename Fn>
+        void
+        record(Fn fn) {
+            const std::lock_guard<std::mutex> lock(_entry->_mutex);
+            fn(_entry->_statistics);
+        }
+    };
+
+    instrumented_file &
+    file_of(sqlite3_file *f) {
+        return *reinterpret_cast<instrumented_file *>(f);
+    }
+
+    int
+    do_close(sqlite3_file *f) {
+        instrumented_file &file = file_of(f);
+        const int result = file.methods().xClose(file.underlying());
+        file.~instrumented_file();
+        return result;
+    }
+
+    int
+    read_through(instrumented_file &file, void *dest, int amount, sqlite3_int64 offset) {
+        const clock::time_point started = clock::now();
+        const int result = file.methods().xRead(file.underlying(), dest, amount, offset);
+        const uint64_t elapsed = microseconds_since(started);
+        file.record([&](file_io_statistics &s) { s._read_microseconds.record(elapsed); });
+        return result;
+    }
+
+    // A read that starts where the previous one ended is taken as a sign of a scan, and we
+    // fill the buffer from there.  A short read (at the end of the file) leaves the buffer
+    // empty, and we read just what was asked for.
+    //
+    int
+    do_read(sqlite3_file *f, void *dest, int amount, sqlite3_int64 offset) {
+        instrumented_file &file = file_of(f);
+        file.record([&](file_io_statistics &s) { s._reads++; s._bytes_read += amount; });
+
+        if (file._read_ahead_bytes != 0) {
+            if (   offset >= file._buffer_offset
+                && offset + amount <= file._buffer_offset + sqlite3_int64(file._buffer_size)) {
+                memcpy(dest, &file._buffer[size_t(offset - file._buffer_offset)], size_t(amount));
+                file._next_sequential_offset = offset + amount;
+                file.record([](file_io_statistics &s) { s._read_ahead_hits++; });
+                return SQLITE_OK;
+            }
+            if (offset == file._next_sequential_offset  &&  size_t(amount) < file._read_ahead_bytes) {
+                file._buffer.resize(file._read_ahead_bytes);
+                file.drop_buffer();
+                if (read_through(file, file._buffer.data(), int(file._read_ahead_bytes), offset) == SQLITE_OK) {
+                    file._buffer_offset = offset;
+                    file._buffer_size = file._read_ahead_bytes;
+                    memcpy(dest, file._buffer.data(), size_t(amount));
+                    file._next_sequential_offset = offset + amount;
+                    return SQLITE_OK;
+                }
+            }
+            file._next_sequential_offset = offset + amount;
+        }
+        return read_through(file, dest, amount, offset);
+    }
+
+    int
+    do_write(sqlite3_file *f, const void *src, int amount, sqlite3_int64 offset) {
+        instrumented_file &file = file_of(f);
+        file.drop_buffer();
+        const clock::time_point started = clock::now();
+        const int result = file.methods().xWrite(file.underlying(), src, amount, offset);
+        const uint64_t elapsed = microseconds_since(started);
+        file.record([&](file_io_statistics &s) {
+            s._writes++;
+            s._bytes_written += amount;
+            s._write_microseconds.record(elapsed);
+        });
+        return result;
+    }
+
+    int
+    do_truncate(sqlite3_file *f, sqlite3_int64 size) {
+        instrumented_file &file = file_of(f);
+        file.drop_buffer();
+        return file.methods().xTruncate(file.underlying(), size);
+    }
+
+    int
+    do_sync(sqlite3_file *f, int flags) {
+        instrumented_file &file = file_of(f);
+        const clock::time_point started = clock::now();
+        const int result = file.methods().xSync(file.underlying(), flags);
+        const uint64_t elapsed = microseconds_since(started);
+        file.record([&](file_io_statistics &s) {
+            s._syncs++;
+            s._sync_microseconds.record(elapsed);
+        });
+        return result;
+    }
+
+    int
+    do_file_size(sqlite3_file *f, sqlite3_int64 *size) {
+        instrumented_file &file = file_of(f);
+        return file.methods().xFileSize(file.underlying(), size);
+    }
+
+    int
+    do_lock(sqlite3_file *f, int level) {
+        instrumented_file &file = file_of(f);
+        file.drop_buffer();
+        return file.methods().xLock(file.underlying(), level);
+    }
+
+    int
+    do_unlock(sqlite3_file *f, int level) {
+        instrumented_file &file = file_of(f);
+        file.drop_buffer();
+        return file.methods().xUnlock(file.underlying(), level);
+    }
+
+    int
+    do_check_reserved_lock(sqlite3_file *f, int *result) {
+        instrumented_file &file = file_of(f);
+        return file.methods().xCheckReservedLock(file.underlying(), result);
+    }
+
+    int
+    do_file_control(sqlite3_file *f, int op, void *arg) {
+        instrumented_file &file = file_of(f);
+        return file.methods().xFileControl(file.underlying(), op, arg);
+    }
+
+    int
+    do_sector_size(sqlite3_file *f) {
+        instrumented_file &file = file_of(f);
+        return file.methods().xSectorSize(file.underlying());
+    }
+
+    int
+    do_device_characteristics(sqlite3_file *f) {
+        instrumented_file &file = file_of(f);
+        return file.methods().xDeviceCharacteristics(file.underlying());
+    }
+
+    int
+    do_shm_map(sqlite3_file *f, int region, int size, int extend, void volatile **pp) {
+        instrumented_file &file = file_of(f);
+        file.drop_buffer();
+        return file.methods().xShmMap(file.underlying(), region, size, extend, pp);
+    }
+
+    // In WAL mode the connection keeps its SHARED lock on the database file from one read
+    // transaction to the next, and each transaction begins by locking a read mark in shared
+    // memory instead.  Meanwhile a checkpoint may have written pages into the file.
+    //
+    int
+    do_shm_lock(sqlite3_file *f, int offset, int n, int flags) {
+        instrumented_file &file = file_of(f);
+        if (flags & SQLITE_SHM_LOCK)  file.drop_buffer();
+        return file.methods().xShmLock(file.underlying(), offset, n, flags);
+    }
+
+    void
+    do_shm_barrier(sqlite3_file *f) {
+        instrumented_file &file = file_of(f);
+        file.methods().xShmBarrier(file.underlying());
+    }
+
+    int
+    do_shm_unmap(sqlite3_file *f, int delete_flag) {
+        instrumented_file &file = file_of(f);
+        return file.methods().xShmUnmap(file.underlying(), delete_flag);
+    }
+
+    int
+    do_fetch(sqlite3_file *f, sqlite3_int64 offset, int amount, void **pp) {
+        instrumented_file &file = file_of(f);
+        return file.methods().xFetch(file.underlying(), offset, amount, pp);
+    }
+
+    int
+    do_unfetch(sqlite3_file *f, sqlite3_int64 offset, void *p) {
+        instrumented_file &file = file_of(f);
+        return file.methods().xUnfetch(file.underlying(), offset, p);
+    }
+
+    // One set of methods for each iVersion that an underlying file might have, so that we
+    // never offer SQLite a method that we can't pass through.
+    //
+    const sqlite3_io_methods *
+    methods_for_version(int version) {
+        static const sqlite3_io_methods all_versions[3] = {
+            {
+                1, do_close, do_read, do_write, do_truncate, do_sync, do_file_size, do_lock, do_unlock,
+                do_check_reserved_lock, do_file_control, do_sector_size, do_device_characteristics,
+                nullptr, nullptr, nullptr, nullptr, nullptr, nullptr
+            },
+            {
+                2, do_close, do_read, do_write, do_truncate, do_sync, do_file_size, do_lock, do_unlock,
+                do_check_reserved_lock, do_file_control, do_sector_size, do_device_characteristics,
+                do_shm_map, do_shm_lock, do_shm_barrier, do_shm_unmap, nullptr, nullptr
+            },
+            {
+                3, do_close, do_read, do_write, do_truncate, do_sync, do_file_size, do_lock, do_unlock,
+                do_check_reserved_lock, do_file_control, do_sector_size, do_device_characteristics,
+                do_shm_map, do_shm_lock, do_shm_barrier, do_shm_unmap, do_fetch, do_unfetch
+            }
+        };
+        return &all_versions[std::min(std::max(version, 1), 3) - 1];
+    }
+
+    // If the underlying xOpen fails, SQLite won't call xClose, so we must leave pMethods null.
+    //
+    int
+    do_open(sqlite3_vfs *vfs, const char *name, sqlite3_file *f, int flags, int *out_flags) {
+        const shim &s = shim_of(vfs);
+        const file_kind kind = kind_for(flags);
+        instrumented_file &file = *new(f) instrumented_file();
+        file._base.pMethods = nullptr;
+        file._entry = &registry().entry_for(name ? string(name) : "(" + string(name_of(kind)) + ")", kind);
+        file._read_ahead_bytes = kind == file_kind::main_db ? s._read_ahead_bytes : 0;
+        file._next_sequential_offset = -1;
+        file._buffer_offset = 0;
+        file._buffer_size = 0;
+
+        sqlite3_file * const underlying = file.underlying();
+        underlying->pMethods = nullptr;
+        const int result = s._underlying->xOpen(s._underlying, name, underlying, flags, out_flags);
+        if (underlying->pMethods == nullptr) {
+            file.~instrumented_file();
+            return result;
+        }
+        file._base.pMethods = methods_for_version(underlying->pMethods->iVersion);
+        file.record([](file_io_statistics &st) { st._opens++; });
+        return result;
+    }
+
+    int
+    do_delete(sqlite3_vfs *vfs, const char *name, int sync_dir) {
+        sqlite3_vfs * const u = shim_of(vfs)._underlying;
+        return u->xDelete(u, name, sync_dir);
+    }
+
+    int
+    do_access(sqlite3_vfs *vfs, const char *name, int flags, int *result) {
+        sqlite3_vfs * const u = shim_of(vfs)._underlying;
+        return u->xAccess(u, name, flags, result);
+    }
+
+    int
+    do_full_pathname(sqlite3_vfs *vfs, const char *name, int size, char *out) {
+        sqlite3_vfs * const u = shim_of(vfs)._underlying;
+        return u->xFullPathname(u, name, size, out);
+    }
+
+    void *
+    do_dl_open(sqlite3_vfs *vfs, const char *filename) {
+        sqlite3_vfs * const u = shim_of(vfs)._underlying;
+        return u->xDlOpen(u, filename);
+    }
+
+    void
+    do_dl_error(sqlite3_vfs *vfs, int size, char *message) {
+        sqlite3_vfs * const u = shim_of(vfs)._underlying;
+        u->xDlError(u, size, message);
+    }
+
+    void
+    (*do_dl_sym(sqlite3_vfs *vfs, void *handle, const char *symbol))(void) {
+        sqlite3_vfs * const u = shim_of(vfs)._underlying;
+        return u->xDlSym(u, handle, symbol);
+    }
+
+    void
+    do_dl_close(sqlite3_vfs *vfs, void *handle) {
+        sqlite3_vfs * const u = shim_of(vfs)._underlying;
+        u->xDlClose(u, handle);
+    }
+
+    int
+    do_randomness(sqlite3_vfs *vfs, int size, char *out) {
+        sqlite3_vfs * const u = shim_of(vfs)._underlying;
+        return u->xRandomness(u, size, out);
+    }
+
+    int
+    do_sleep(sqlite3_vfs *vfs, int microseconds) {
+        sqlite3_vfs * const u = shim_of(vfs)._underlying;
+        return u->xSleep(u, microseconds);
+    }
+
+    int
+    do_current_time(sqlite3_vfs *vfs, double *result) {
+        sqlite3_vfs * const u = shim_of(vfs)._underlying;
+        return u->xCurrentTime(u, result);
+    }
+
+    int
+    do_get_last_error(sqlite3_vfs *vfs, int size, char *out) {
+        sqlite3_vfs * const u = shim_of(vfs)._underlying;
+        return u->xGetLastError ? u->xGetLastError(u, size, out) : 0;
+    }
+
+    int
+    do_current_time_int64(sqlite3_vfs *vfs, sqlite3_int64 *result) {
+        sqlite3_vfs * const u = shim_of(vfs)._underlying;
+        return u->xCurrentTimeInt64(u, result);
+    }
+
+    int
+    do_set_system_call(sqlite3_vfs *vfs, const char *name, sqlite3_syscall_ptr p) {
+        sqlite3_vfs * const u = shim_of(vfs)._underlying;
+        return u->xSetSystemCall(u, name, p);
+    }
+
+    sqlite3_syscall_ptr
+    do_get_system_call(sqlite3_vfs *vfs, const char *name) {
+        sqlite3_vfs * const u = shim_of(vfs)._underlying;
+        return u->xGetSystemCall(u, name);
+    }
+
+    const char *
+    do_next_system_call(sqlite3_vfs *vfs, const char *name) {
+        sqlite3_vfs * const u = shim_of(vfs)._underlying;
+        return u->xNextSystemCall(u, name);
+    }
+}
+
+
+// Shims are registered for the life of the process, so their addresses never change.
+//
+string
+register_instrumented_vfs(const optional<string> &underlying_vfs_name, size_t read_ahead_bytes) {
+    static std::mutex mutex;
+    static map<string, unique_ptr<shim>> shims;
+
+    string name = "quince_sqlite_instrumented";
+    if (underlying_vfs_name)    name += "+" + *underlying_vfs_name;
+    if (read_ahead_bytes != 0)  name += ":read_ahead=" + std::to_string(read_ahead_bytes);
+
+    const std::lock_guard<std::mutex> lock(mutex);
+    if (shims.count(name) != 0)  return name;
+
+    sqlite3_vfs * const underlying = sqlite3_vfs_find(underlying_vfs_name ? underlying_vfs_name->c_str() : nullptr);
+    if (underlying == nullptr)  throw failed_connection_exception();
+
+    auto s = quince::make_unique<shim>();
+    s->_underlying = underlying;
+    s->_read_ahead_bytes = read_ahead_bytes;
+    s->_name = name;
+
+    sqlite3_vfs &v = s->_vfs;
+    memset(&v, 0, sizeof(v));
+    v.iVersion = std::min(underlying->iVersion, 3);
+    v.szOsFile = int(instrumented_file::underlying_offset()) + underlying->szOsFile;
+    v.mxPathname = underlying->mxPathname;
+    v.zName = s->_name.c_str();
+    v.pAppData = s.get();
+    v.xOpen = do_open;
+    v.xDelete = do_delete;
+    v.xAccess = do_access;
+    v.xFullPathname = do_full_pathname;
+    v.xDlOpen = do_dl_open;
+    v.xDlError = do_dl_error;
+    v.xDlSym = do_dl_sym;
+    v.xDlClose = do_dl_close;
+    v.xRandomness = do_randomness;
+    v.xSleep = do_sleep;
+    v.xCurrentTime = do_current_time;
+    v.xGetLastError = do_get_last_error;
+    if (v.iVersion >= 2)  v.xCurrentTimeInt64 = do_current_time_int64;
+    if (v.iVersion >= 3) {
+        v.xSetSystemCall = do_set_system_call;
+        v.xGetSystemCall = do_get_system_call;
+        v.xNextSystemCall = do_next_system_call;
+    }
+
+    if (sqlite3_vfs_register(&v, false) != SQLITE_OK)  throw failed_connection_exception();
+    shims.emplace(name, std::move(s));
+    return name;
+}
+
+map<string, file_io_statistics>
+get_instrumented_vfs_statistics() {
+    statistics_registry &r = registry();
+    const std::lock_guard<std::mutex> lock(r._mutex);
+    map<string, file_io_statistics> result;
+    for (const auto &e: r._entries) {
+        const std::lock_guard<std::mutex> entry_lock(e.second->_mutex);
+        result.emplace(e.first, e.second->_statistics);
+    }
+    return result;
+}
+
+void
+reset_instrumented_vfs_statistics() {
+    statistics_registry &r = registry();
+    const std::lock_guard<std::mutex> lock(r._mutex);
+    for (const auto &e: r._entries) {
+        const std::lock_guard<std::mutex> entry_lock(e.second->_mutex);
+        const file_kind kind = e.second->_statistics._kind;
+        e.second->_statistics = file_io_statistics();
+        e.second->_statistics._kind = kind;
+    }
+}
+
+}
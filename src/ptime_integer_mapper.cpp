@@ -0,0 +1,80 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <limits>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <quince/detail/util.h>
+#include <quince/query.h>
+#include <quince_sqlite/ptime_integer_mapper.h>
+
+using namespace quince;
+using boost::optional;
+using boost::posix_time::ptime;
+using std::numeric_limits;
+using std::string;
+
+
+QUINCE_SUPPRESS_MSVC_DOMINANCE_WARNING
+
+namespace quince_sqlite {
+
+namespace {
+    const int64_t not_a_date_time_microseconds = numeric_limits<int64_t>::min();
+    const int64_t neg_infin_microseconds = numeric_limits<int64_t>::min() + 1;
+    const int64_t pos_infin_microseconds = numeric_limits<int64_t>::max();
+
+    const ptime epoch(boost::gregorian::date(1970, 1, 1));
+}
+
+
+ptime_integer_mapper::ptime_integer_mapper(const optional<string> &name, const mapper_factory &creator) :
+    abstract_mapper_base(name),
+    abstract_mapper<ptime>(name),
+    direct_mapper<int64_t>(name, creator)
+{}
+
+std::unique_ptr<cloneable>
+ptime_integer_mapper::clone_impl() const {
+    return quince::make_unique<ptime_integer_mapper>(*this);
+}
+
+void
+ptime_integer_mapper::from_row(const row &src, ptime &dest) const {
+    int64_t microseconds;
+    direct_mapper<int64_t>::from_row(src, microseconds);
+    dest = from_microseconds(microseconds);
+}
+
+void
+ptime_integer_mapper::to_row(const ptime &src, row &dest) const {
+    direct_mapper<int64_t>::to_row(to_microseconds(src), dest);
+}
+
+int64_t
+ptime_integer_mapper::to_microseconds(const ptime &t) {
+    if (t.is_not_a_date_time())     return not_a_date_time_microseconds;
+    if (t.is_neg_infinity())        return neg_infin_microseconds;
+    if (t.is_pos_infinity())        return pos_infin_microseconds;
+    return (t - epoch).total_microseconds();
+}
+
+ptime
+ptime_integer_mapper::from_microseconds(int64_t microseconds) {
+    switch (microseconds) {
+        case not_a_date_time_microseconds:  return ptime(boost::posix_time::not_a_date_time);
+        case neg_infin_microseconds:        return ptime(boost::posix_time::neg_infin);
+        case pos_infin_microseconds:        return ptime(boost::posix_time::pos_infin);
+        default:                            return epoch + boost::posix_time::microseconds(microseconds);
+    }
+}
+
+void
+ptime_integer_mapper::build_match_tester(const query_base &qb, predicate &result) const {
+    abstract_mapper<ptime>::build_match_tester(qb, result);
+}
+
+}
+
+QUINCE_UNSUPPRESS_MSVC_WARNING
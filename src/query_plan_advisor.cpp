@@ -0,0 +1,325 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <ctype.h>
+#include <string.h>
+#include <algorithm>
+#include <sqlite3.h>
+#include <quince_sqlite/detail/query_plan_advisor.h>
+
+using std::string;
+using std::vector;
+
+
+namespace quince_sqlite {
+
+namespace {
+    bool
+    starts_with(const string &s, const char *prefix) {
+        return s.compare(0, strlen(prefix), prefix) == 0;
+    }
+
+    // The name of the table that follows "SCAN " or "SEARCH " (and, in the output of SQLite
+    // versions before 3.36, "TABLE "), without quotes or an "AS alias".
+    //
+    string
+    table_after(const string &detail, size_t pos) {
+        if (detail.compare(pos, 6, "TABLE ") == 0)  pos += 6;
+        const size_t end = detail.find(' ', pos);
+        string result = detail.substr(pos, end == string::npos ? string::npos : end - pos);
+        if (result.size() >= 2  &&  result.front() == '"'  &&  result.back() == '"')
+            result = result.substr(1, result.size() - 2);
+        return result;
+    }
+
+    // The columns named in the constraint list of an automatic index, e.g. "(a=? AND b>?)".
+    //
+    vector<string>
+    constrained_columns(const string &detail) {
+        vector<string> result;
+        const size_t open = detail.find('(');
+        const size_t close = detail.rfind(')');
+        if (open == string::npos  ||  close == string::npos  ||  close < open)  return result;
+
+        size_t pos = open + 1;
+        while (pos < close) {
+            size_t end = pos;
+            while (end < close  &&  (isalnum(static_cast<unsigned char>(detail[end]))  ||  detail[end] == '_'  ||  detail[end] == '$'))
+                end++;
+            if (end > pos)  result.push_back(detail.substr(pos, end - pos));
+
+            const size_t next = detail.find(" AND ", end);
+            if (next == string::npos  ||  next >= close)  break;
+            pos = next + 5;
+        }
+        return result;
+    }
+
+    // The alias in e.g. "SCAN items AS i", or else the table name.
+    //
+    string
+    qualifier_in(const string &detail, const string &table) {
+        const size_t as = detail.find(" AS ");
+        if (as == string::npos)  return table;
+        return table_after(detail, as + 4);
+    }
+
+    string
+    upper_case(const string &s) {
+        string result = s;
+        for (char &c: result)  c = char(toupper(static_cast<unsigned char>(c)));
+        return result;
+    }
+
+    // An identifier starting at pos, quoted or not, without its quotes.  Leaves pos after it.
+    //
+    string
+    identifier_at(const string &text, size_t &pos) {
+        string result;
+        if (pos < text.size()  &&  strchr("\"`[", text[pos])) {
+            const char close = text[pos] == '[' ? ']' : text[pos];
+            for (pos++; pos < text.size(); pos++) {
+                if (text[pos] == close  &&  pos + 1 < text.size()  &&  text[pos + 1] == close  &&  close != ']')  pos++;
+                else if (text[pos] == close)  { pos++; break; }
+                result += text[pos];
+            }
+        }
+        else
+            while (pos < text.size()  &&  (isalnum(static_cast<unsigned char>(text[pos]))  ||  text[pos] == '_'  ||  text[pos] == '$'))
+                result += text[pos++];
+        return result;
+    }
+
+    // The columns that clause refers to as qualifier.column, in order of first appearance.
+    //
+    void
+    add_qualified_columns(const string &clause, const string &qualifier, vector<string> &columns) {
+        size_t pos = 0;
+        while (pos < clause.size()) {
+            const char c = clause[pos];
+            if (c == '\'') {
+                const size_t end = clause.find('\'', pos + 1);
+                pos = end == string::npos ? clause.size() : end + 1;
+                continue;
+            }
+            const size_t start = pos;
+            const string name = identifier_at(clause, pos);
+            if (pos == start) {
+                pos++;
+                continue;
+            }
+            if (pos < clause.size()  &&  clause[pos] == '.'  &&  name == qualifier) {
+                pos++;
+                const string column = identifier_at(clause, pos);
+                if (! column.empty()  &&  std::find(columns.begin(), columns.end(), column) == columns.end())
+                    columns.push_back(column);
+            }
+        }
+    }
+
+    // The columns of the table called qualifier that sql_text filters on, then the ones it
+    // sorts by: the likeliest key for an index.  Only the outermost WHERE and ORDER BY are
+    // looked at, and only qualified column names are recognized, as quince writes them.
+    //
+    vector<string>
+    candidate_columns(const string &sql_text, const string &qualifier, bool order_by_only) {
+        vector<string> result;
+        if (qualifier.empty())  return result;
+
+        const string upper = upper_case(sql_text);
+        const size_t where = upper.rfind(" WHERE ");
+        const size_t order_by = upper.rfind(" ORDER BY ");
+        if (! order_by_only  &&  where != string::npos) {
+            const size_t end = order_by != string::npos  &&  order_by > where ? order_by : string::npos;
+            add_qualified_columns(sql_text.substr(where, end == string::npos ? string::npos : end - where), qualifier, result);
+        }
+        if (order_by != string::npos)
+            add_qualified_columns(sql_text.substr(order_by), qualifier, result);
+        return result;
+    }
+
+    // The statements that have query plans worth looking at: not DDL or transaction control.
+    //
+    bool
+    has_plan(const string &sql_text) {
+        for (const char *keyword: { "SELECT ", "WITH ", "INSERT ", "UPDATE ", "DELETE ", "REPLACE " })
+            if (sqlite3_strnicmp(sql_text.c_str(), keyword, int(strlen(keyword))) == 0)
+                return true;
+        return false;
+    }
+
+    // The table that every column in a plain ORDER BY list belongs to, if there is one.
+    //
+    string
+    order_by_qualifier(const string &sql_text) {
+        const size_t order_by = upper_case(sql_text).rfind(" ORDER BY ");
+        if (order_by == string::npos)  return string();
+
+        const string clause = sql_text.substr(order_by + 10);
+        size_t pos = 0;
+        while (pos < clause.size()  &&  isspace(static_cast<unsigned char>(clause[pos])))  pos++;
+        const string result = identifier_at(clause, pos);
+        return pos < clause.size()  &&  clause[pos] == '.' ? result : string();
+    }
+
+    // The table that sql_text gives the alias to, as in "FROM items AS i", or else alias itself.
+    // (Newer versions of SQLite name a table by its alias alone in the plan.)
+    //
+    string
+    table_with_alias(const string &sql_text, const string &alias) {
+        const string upper = upper_case(sql_text);
+        for (size_t as = upper.find(" AS "); as != string::npos; as = upper.find(" AS ", as + 4)) {
+            size_t pos = as + 4;
+            if (identifier_at(sql_text, pos) != alias)  continue;
+
+            size_t end = as;
+            size_t start = end;
+            if (start > 0  &&  strchr("\"`]", sql_text[start - 1])) {
+                const char open = sql_text[start - 1] == ']' ? '[' : sql_text[start - 1];
+                start = sql_text.rfind(open, start - 2);
+                if (start == string::npos)  continue;
+            }
+            else
+                while (start > 0  &&  (isalnum(static_cast<unsigned char>(sql_text[start - 1]))  ||  sql_text[start - 1] == '_'  ||  sql_text[start - 1] == '$'))
+                    start--;
+            pos = start;
+            const string result = identifier_at(sql_text, pos);
+            if (! result.empty()  &&  pos == end)  return result;
+        }
+        return alias;
+    }
+
+    const size_t examined_capacity = 4096;
+
+    string
+    suggestion_for(const string &table, const vector<string> &columns) {
+        if (table.empty()  ||  columns.empty())  return string();
+
+        string result = table + ".specify_index(";
+        for (size_t i = 0; i < columns.size(); i++)
+            result += (i == 0 ? "" : ", ") + table + "->" + columns[i];
+        return result + ")";
+    }
+}
+
+
+// A statement whose EXPLAIN can't be prepared (e.g. because a table it uses doesn't exist
+// yet) isn't remembered, so it will be examined again next time.
+//
+void
+query_plan_advisor::examine(sqlite3 *conn, const string &sql_text) {
+    if (! has_plan(sql_text))  return;
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        const auto found = _examined_index.find(sql_text);
+        if (found != _examined_index.end()) {
+            _examined.splice(_examined.end(), _examined, found->second);
+            return;
+        }
+    }
+
+    sqlite3_stmt *stmt = nullptr;
+    const string explain = "EXPLAIN QUERY PLAN " + sql_text;
+    if (sqlite3_prepare_v2(conn, explain.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        sqlite3_finalize(stmt);
+        return;
+    }
+
+    vector<query_plan_finding> findings;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const int detail_column = sqlite3_column_count(stmt) - 1;
+        const auto detail = reinterpret_cast<const char *>(sqlite3_column_text(stmt, detail_column));
+        query_plan_finding f;
+        if (detail  &&  analyse(detail, f)) {
+            f._sql = sql_text;
+            add_candidate_columns(f);
+            findings.push_back(std::move(f));
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    const std::lock_guard<std::mutex> lock(_mutex);
+    if (_examined_index.count(sql_text))  return;     // another thread got there first
+    _examined_index.emplace(sql_text, _examined.insert(_examined.end(), sql_text));
+    if (_examined.size() > examined_capacity) {
+        _examined_index.erase(_examined.front());
+        _examined.pop_front();
+    }
+    _findings.insert(_findings.end(), findings.begin(), findings.end());
+}
+
+// The plan says which columns an automatic index covers, but for a full scan or a sort we
+// have to go by the SQL.
+//
+void
+query_plan_advisor::add_candidate_columns(query_plan_finding &f) {
+    if (! f._columns.empty())  return;
+
+    switch (f._kind) {
+        case query_plan_finding::kind::full_scan: {
+            const string qualifier = qualifier_in(f._detail, f._table);
+            f._table = table_with_alias(f._sql, qualifier);
+            f._columns = candidate_columns(f._sql, qualifier, false);
+            break;
+        }
+        case query_plan_finding::kind::temp_b_tree: {
+            if (f._detail.find("ORDER BY") == string::npos)  return;
+            const string qualifier = order_by_qualifier(f._sql);
+            f._table = table_with_alias(f._sql, qualifier);
+            f._columns = candidate_columns(f._sql, qualifier, true);
+            break;
+        }
+        default:
+            return;
+    }
+    f._suggestion = suggestion_for(f._table, f._columns);
+}
+
+vector<query_plan_finding>
+query_plan_advisor::get_findings() const {
+    const std::lock_guard<std::mutex> lock(_mutex);
+    return _findings;
+}
+
+void
+query_plan_advisor::clear() {
+    const std::lock_guard<std::mutex> lock(_mutex);
+    _examined.clear();
+    _examined_index.clear();
+    _findings.clear();
+}
+
+bool
+query_plan_advisor::analyse(const string &detail, query_plan_finding &result) {
+    result._detail = detail;
+
+    if (starts_with(detail, "USE TEMP B-TREE")) {
+        result._kind = query_plan_finding::kind::temp_b_tree;
+        return true;
+    }
+    if (detail.find("AUTOMATIC ") != string::npos  &&  detail.find(" INDEX") != string::npos) {
+        result._kind = query_plan_finding::kind::automatic_index;
+        if (starts_with(detail, "SEARCH "))  result._table = table_after(detail, 7);
+        result._columns = constrained_columns(detail);
+        result._suggestion = suggestion_for(result._table, result._columns);
+        return true;
+    }
+    if (starts_with(detail, "SCAN ")) {
+        // A scan that goes through an index, or over a subquery or a constant row, isn't what
+        // we're looking for.
+        //
+        if (detail.find(" USING ") != string::npos)     return false;
+        if (starts_with(detail, "SCAN SUBQUERY"))       return false;
+        if (starts_with(detail, "SCAN CONSTANT ROW"))   return false;
+        if (detail.compare(5, 1, "(") == 0)             return false;
+
+        result._kind = query_plan_finding::kind::full_scan;
+        result._table = table_after(detail, 5);
+        return true;
+    }
+    return false;
+}
+
+}
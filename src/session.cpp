@@ -4,7 +4,12 @@
 //          http://www.boost.org/LICENSE_1_0.txt)
 
 #include <assert.h>
+#include <ctype.h>
 #include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <iterator>
 #include <string>
 #include <vector>
 #include <boost/optional.hpp>
@@ -15,8 +20,10 @@
 #include <quince/detail/util.h>
 #include <sqlite3.h>
 #include <quince_sqlite/database.h>
+#include <quince_sqlite/detail/connection_pool.h>
 #include <quince_sqlite/detail/dialect_sql.h>
 #include <quince_sqlite/detail/session.h>
+#include <quince_sqlite/detail/statement_profiler.h>
 
 using boost::optional;
 using namespace quince;
@@ -31,19 +38,44 @@ namespace quince_sqlite {
 
 class session_impl::statement : public abstract_result_stream_impl {
 public:
-    statement(sqlite3 *conn, const sql &cmd) :
-        _stmt(prepare(conn, cmd.get_text(), _construction_result_code))
+    // sql_text is cmd's text, after any rewriting that SQLite needs.  If cmd_outlives_us is
+    // true, SQLite uses cmd's text and blob parameters where they are, instead of copying them.
+    //
+    statement(
+        const shared_ptr<connection> &conn,
+        const string &sql_text,
+        const sql &cmd,
+        bool cmd_outlives_us,
+        statement_profiler *profiler
+    ) :
+        _conn(conn),
+        _sql_text(sql_text),
+        _profiler(profiler),
+        _sample(),
+        _prepared(acquire()),
+        _stmt(_prepared._stmt),
+        _rows_stepped(0),
+        _batch_size(1),
+        _batch_pos(0),
+        _batch_end_result_code(SQLITE_ROW)
     {
         if (_construction_result_code == SQLITE_OK) {
+            const sqlite3_destructor_type lifetime = cmd_outlives_us ? SQLITE_STATIC : SQLITE_TRANSIENT;
             int i = 1;
             for (const cell &c: cmd.get_input().values())
-                if ((_construction_result_code = bind(c, i++)) != SQLITE_OK)
+                if ((_construction_result_code = bind(c, i++, lifetime)) != SQLITE_OK)
                     break;
         }
     }
 
     ~statement() {
-        finalize(_stmt);
+        if (_profiler  &&  _stmt)  report();
+        _conn->statements().release(_sql_text, std::move(_prepared));
+    }
+
+    const shared_ptr<connection> &
+    get_connection() const {
+        return _conn;
     }
 
     int
@@ -51,36 +83,106 @@ public:
         if (_construction_result_code != SQLITE_OK)  return _construction_result_code;
 
         assert(_stmt != nullptr);
-        const int result_code = sqlite3_step(_stmt);
+        const clock::time_point started = _profiler ? clock::now() : clock::time_point();
+        const int result_code = _conn->step(_stmt, _rows_stepped);
+        if (_profiler)  _sample._step_microseconds += microseconds_since(started);
+        if (result_code == SQLITE_ROW)  _rows_stepped++;
         if (result_code == SQLITE_ROW  &&  r != nullptr) {
+            const vector<string> &names = column_names();
             const int n = sqlite3_data_count(_stmt);
             for (int i = 0; i < n; i++)
-                r->add_cell(extract(i), sqlite3_column_name(_stmt, i));
+                r->add_cell(extract(i), names[i]);
         }
         return result_code;
     }
 
-private:
-    static sqlite3_stmt *
-    prepare(sqlite3 *conn, const string &sql_text, int &result_code) {
-        sqlite3_stmt *result;
-        result_code = sqlite3_prepare_v2(conn, sql_text.c_str(), -1, &result, nullptr);
-        if (result_code != SQLITE_OK) {
-            finalize(result);
-            return nullptr;
+    void
+    set_batch_size(uint32_t batch_size) {
+        _batch_size = std::max(batch_size, uint32_t(1));
+        _batch.reserve(_batch_size);
+    }
+
+    // Hands out the next row in dest, and returns SQLITE_ROW, or else the result code that
+    // ended the stream.  When the batch runs dry, steps up to _batch_size rows ahead to refill
+    // it, so that the caller's per-row overheads are paid once per batch.  If the refill stops
+    // on an error, the rows before it are still delivered, and then the error is returned.
+    //
+    int
+    next_buffered(const database &db, unique_ptr<row> &dest) {
+        if (_batch_pos == _batch.size()) {
+            _batch.clear();
+            _batch_pos = 0;
+            while (_batch_end_result_code == SQLITE_ROW  &&  _batch.size() < _batch_size) {
+                auto r = quince::make_unique<row>(&db);
+                if ((_batch_end_result_code = next(r.get())) == SQLITE_ROW)
+                    _batch.push_back(std::move(r));
+            }
         }
-        assert(result != nullptr);
+        if (_batch_pos == _batch.size())  return _batch_end_result_code;
+
+        dest = std::move(_batch[_batch_pos++]);
+        return SQLITE_ROW;
+    }
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    static uint64_t
+    microseconds_since(clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count();
+    }
+
+    statement_cache::prepared
+    acquire() {
+        const clock::time_point started = _profiler ? clock::now() : clock::time_point();
+        bool was_cached;
+        statement_cache::prepared result = _conn->statements().acquire(_sql_text, _construction_result_code, was_cached);
+        _sample._prepared = ! was_cached;
+        if (_profiler)  _sample._prepare_microseconds = microseconds_since(started);
         return result;
     }
 
+    // The sqlite3_stmt_status() counters are reset as we read them, so that each execution
+    // of a cached statement reports only its own.
+    //
+    void
+    report() {
+        _sample._rows = _rows_stepped;
+        _sample._fullscan_steps = sqlite3_stmt_status(_stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, true);
+        _sample._sorts = sqlite3_stmt_status(_stmt, SQLITE_STMTSTATUS_SORT, true);
+        _sample._autoindexes = sqlite3_stmt_status(_stmt, SQLITE_STMTSTATUS_AUTOINDEX, true);
+        _sample._vm_steps = sqlite3_stmt_status(_stmt, SQLITE_STMTSTATUS_VM_STEP, true);
+        _profiler->record(_sql_text, _sample);
+    }
+
+    // SQLite may re-prepare the statement if the schema changes, and then the columns may
+    // change too, so the cached names are only trusted while the re-prepare count holds still.
+    //
+    const vector<string> &
+    column_names() {
+        const int reprepare_count = sqlite3_stmt_status(_stmt, SQLITE_STMTSTATUS_REPREPARE, false);
+        if (reprepare_count != _prepared._reprepare_count) {
+            const int n = sqlite3_column_count(_stmt);
+            _prepared._column_names.clear();
+            _prepared._column_names.reserve(n);
+            for (int i = 0; i < n; i++)
+                _prepared._column_names.push_back(sqlite3_column_name(_stmt, i));
+            _prepared._reprepare_count = reprepare_count;
+        }
+        return _prepared._column_names;
+    }
+
+    // With SQLITE_STATIC, the statement cache's sqlite3_clear_bindings() makes sure that SQLite
+    // forgets the pointers before the cell can go away.
+    //
     int
-    bind(const cell &c, int index) {
+    bind(const cell &c, int index, sqlite3_destructor_type lifetime) {
         assert(_stmt != nullptr);
         switch(c.type()) {
             case column_type::big_int:          return sqlite3_bind_int64(_stmt, index, c.get<int64_t>());
             case column_type::double_precision: return sqlite3_bind_double(_stmt, index, c.get<double>());
-            case column_type::string:           return sqlite3_bind_text(_stmt, index, c.chars(), int(c.size()), SQLITE_TRANSIENT);
-            case column_type::byte_vector:      return sqlite3_bind_blob(_stmt, index, c.data(), int(c.size()), SQLITE_TRANSIENT);
+            case column_type::string:           return sqlite3_bind_text(_stmt, index, c.chars(), int(c.size()), lifetime);
+            case column_type::byte_vector:      return sqlite3_bind_blob(_stmt, index, c.data(), int(c.size()), lifetime);
             case column_type::none:             return sqlite3_bind_null(_stmt, index);
             default:                            abort();
         }
@@ -100,98 +202,193 @@ private:
         }
     }
 
-    static void
-    finalize(sqlite3_stmt *stmt) {
-        if (stmt != nullptr)  sqlite3_finalize(stmt);
-    }
-
+    // Ask for the data before its size, as the SQLite docs recommend, and pass the size on,
+    // so that the text is copied exactly once and never scanned for its terminator.
+    //
     string
     column_to_string(int index) const {
-        return reinterpret_cast<const char *>(sqlite3_column_text(_stmt, index));
+        const auto chars = reinterpret_cast<const char *>(sqlite3_column_text(_stmt, index));
+        return string(chars, size_t(sqlite3_column_bytes(_stmt, index)));
     }
 
     vector<uint8_t>
     column_to_byte_vector(int index)  const {
-        vector<uint8_t> result;
         if (const auto base_addr = static_cast<const uint8_t *>(sqlite3_column_blob(_stmt, index)))
-            result.assign(base_addr, base_addr + sqlite3_column_bytes(_stmt, index));
-        return result;
+            return vector<uint8_t>(base_addr, base_addr + sqlite3_column_bytes(_stmt, index));
+        return vector<uint8_t>();
     }
 
+    const shared_ptr<connection> _conn;
+    const string _sql_text;
+    statement_profiler * const _profiler;
+    statement_sample _sample;
     int _construction_result_code;
+    statement_cache::prepared _prepared;
     sqlite3_stmt * const _stmt;
+    uint64_t _rows_stepped;
+    uint32_t _batch_size;
+    vector<unique_ptr<row>> _batch;
+    size_t _batch_pos;
+    int _batch_end_result_code;
 };
 
 
 namespace {
-    sqlite3 *
-    connect(const session_impl::spec &spec) {
-        sqlite3 *result;
-        int result_code = sqlite3_open_v2(
-            spec._filename.c_str(),
-            &result,
-            spec._flags,
-            spec._vfs_module_name ? spec._vfs_module_name->c_str() : nullptr
-        );
-        if (result_code != SQLITE_OK) {
-            if (result != nullptr)  sqlite3_close(result);
-            return nullptr;
+    // Statements that only read, and so may go to one of a pool's read-only connections.
+    // Anything else, including transaction control, goes to the pool's writer.
+    //
+    bool
+    starts_with_keyword(const string &sql_text, const char *keyword) {
+        return sqlite3_strnicmp(sql_text.c_str(), keyword, int(strlen(keyword))) == 0;
+    }
+
+    // Some PRAGMAs change the database even without a value, e.g. wal_checkpoint, optimize
+    // and incremental_vacuum, so only the ones listed here go to a reader: those that report
+    // something about a table or index, given its name, and those that only report, provided
+    // they are given no value.
+    //
+    bool
+    is_read_only_pragma(const string &sql_text) {
+        static const char * const lookups[] = {
+            "table_info", "table_xinfo", "table_list", "index_info", "index_xinfo", "index_list",
+            "foreign_key_list"
+        };
+        static const char * const reports[] = {
+            "schema_version", "user_version", "data_version", "application_id", "page_count",
+            "page_size", "freelist_count", "database_list", "compile_options", "collation_list",
+            "function_list", "module_list", "pragma_list"
+        };
+
+        // Skip the schema name, if any, e.g. "enclosure".table_info(...)
+        //
+        size_t pos = strlen("PRAGMA ");
+        if (sql_text[pos] == '"') {
+            const size_t closing = sql_text.find('"', pos+1);
+            if (closing == string::npos  ||  sql_text[closing+1] != '.')  return false;
+            pos = closing + 2;
         }
-        assert(result != nullptr);
-        return result;
+        size_t end = pos;
+        while (end < sql_text.size()  &&  (isalnum(static_cast<unsigned char>(sql_text[end]))  ||  sql_text[end] == '_'))
+            end++;
+        if (end < sql_text.size()  &&  sql_text[end] == '.') {
+            pos = ++end;
+            while (end < sql_text.size()  &&  (isalnum(static_cast<unsigned char>(sql_text[end]))  ||  sql_text[end] == '_'))
+                end++;
+        }
+        const string name = sql_text.substr(pos, end - pos);
+        const auto is_named = [&](const char *candidate) {
+            return sqlite3_stricmp(name.c_str(), candidate) == 0;
+        };
+
+        if (std::any_of(std::begin(lookups), std::end(lookups), is_named))
+            return end == sql_text.size()  ||  sql_text[end] == '(';
+        if (std::any_of(std::begin(reports), std::end(reports), is_named))
+            return sql_text.find_first_not_of(" ;", end) == string::npos;
+        return false;
     }
-}
 
+    // A WITH clause may lead to an INSERT, UPDATE or DELETE, as well as to a SELECT.  Rather
+    // than parse it, we look for those words outside quotes.  (REPLACE may just be the function,
+    // but then the statement only goes to the writer unnecessarily.)
+    //
+    bool
+    mentions_data_change(const string &sql_text) {
+        size_t pos = 0;
+        while (pos < sql_text.size()) {
+            const char c = sql_text[pos];
+            if (c == '\''  ||  c == '"') {
+                const size_t closing = sql_text.find(c, pos+1);
+                if (closing == string::npos)  break;
+                pos = closing + 1;
+            }
+            else if (isalpha(static_cast<unsigned char>(c))  ||  c == '_') {
+                size_t end = pos;
+                while (end < sql_text.size()  &&  (isalnum(static_cast<unsigned char>(sql_text[end]))  ||  sql_text[end] == '_'))
+                    end++;
+                const string word = sql_text.substr(pos, end - pos);
+                for (const char *keyword: { "INSERT", "UPDATE", "DELETE", "REPLACE" })
+                    if (sqlite3_stricmp(word.c_str(), keyword) == 0)  return true;
+                pos = end;
+            }
+            else
+                pos++;
+        }
+        return false;
+    }
 
-session_impl::session_impl(const database &database, const session_impl::spec &spec) :
-    _database(database),
-    _conn(connect(spec))
-{
-    if (! _conn)  throw failed_connection_exception();
+    bool
+    reads_only(const string &sql_text) {
+        return starts_with_keyword(sql_text, "SELECT ")
+            || (starts_with_keyword(sql_text, "WITH ")  &&  ! mentions_data_change(sql_text))
+            || (starts_with_keyword(sql_text, "PRAGMA ")  &&  is_read_only_pragma(sql_text));
+    }
 }
 
-session_impl::~session_impl() {
-    if (_conn)  sqlite3_close(_conn);
-}
+
+session_impl::session_impl(const database &database, const session_impl::spec &spec, connection_pool *pool) :
+    _database(database),
+    _pool(pool),
+    _dedicated(
+        pool
+            ? nullptr
+            : std::make_shared<connection>(spec)
+    ),
+    _reader_is_stale(false),
+    _last_insert_rowid(0)
+{}
+
+session_impl::~session_impl()
+{}
 
 bool
 session_impl::unchecked_exec(const sql &cmd) {
-    return make_stmt(cmd)->next() == SQLITE_DONE;
+    const unique_ptr<statement> stmt = make_stmt(cmd);
+    const bool result = stmt->next() == SQLITE_DONE;
+    after_step(*stmt);
+    return result;
 }
 
 unique_ptr<row>
 session_impl::exec_with_one_output(const sql &cmd) {
     auto result = quince::make_unique<row>(&_database);
-    statement stmt(_conn, cmd);
-    switch(int result_code = stmt.next(result.get())) {
+    const unique_ptr<statement> stmt = make_stmt(cmd);
+    switch(int result_code = stmt->next(result.get())) {
         case SQLITE_DONE:   return nullptr;
         case SQLITE_ROW:    break;
         default:            throw_last_error(result_code);
     }
-    if (stmt.next() != SQLITE_DONE)  throw multi_row_exception();
+    if (stmt->next() != SQLITE_DONE)  throw multi_row_exception();
+    after_step(*stmt);
     return result;
 }
 
+// A result stream may be read long after quince has discarded cmd, so this is the one place
+// where SQLite must copy the parameters.
+//
 result_stream
-session_impl::exec_with_stream_output(const sql &cmd, uint32_t) {
-    return make_stmt(cmd);
+session_impl::exec_with_stream_output(const sql &cmd, uint32_t fetch_size) {
+    const shared_ptr<statement> result = make_stmt(cmd, false);
+    result->set_batch_size(fetch_size);
+    return result;
 }
 
 void
 session_impl::exec(const sql &cmd) {
-    const int result_code = make_stmt(cmd)->next();
+    const unique_ptr<statement> stmt = make_stmt(cmd);
+    const int result_code = stmt->next();
+    after_step(*stmt);
     if (result_code != SQLITE_DONE)  throw_last_error(result_code);
 }
 
 unique_ptr<row>
 session_impl::next_output(const result_stream &rs) {
     assert(rs);
-    shared_ptr<statement> stmt = dynamic_pointer_cast<statement>(rs);
-    assert(stmt);
+    assert(dynamic_pointer_cast<statement>(rs));
+    statement &stmt = static_cast<statement &>(*rs);
 
-    auto result = quince::make_unique<row>(&_database);
+    unique_ptr<row> result;
 
-    switch (const int result_code = stmt->next(result.get())) {
+    switch (const int result_code = stmt.next_buffered(_database, result)) {
     case SQLITE_ROW:    return result;
     case SQLITE_DONE:   return nullptr;
     default:            throw_last_error(result_code);
@@ -201,10 +398,15 @@ session_impl::next_output(const result_stream &rs) {
 serial
 session_impl::last_inserted_serial() const {
     serial result;
-    result.assign(sqlite3_last_insert_rowid(_conn));
+    result.assign(_last_insert_rowid);
     return result;
 }
 
+statement_cache_statistics
+session_impl::get_statement_cache_statistics() const {
+    return _pool ? _pool->get_statement_cache_statistics() : _dedicated->statements().get_statistics();
+}
+
 void
 session_impl::throw_last_error(int last_result_code) const {
     const char * const dbms_message = sqlite3_errstr(last_result_code);
@@ -219,9 +421,90 @@ session_impl::throw_last_error(int last_result_code) const {
 }
 
 std::unique_ptr<session_impl::statement>
-session_impl::make_stmt(const sql &cmd) {
-    _latest_sql = cmd.get_text();
-    return quince::make_unique<statement>(_conn, cmd);
+session_impl::make_stmt(const sql &cmd, bool cmd_outlives_stmt) {
+    const dialect_sql * const dialect = dynamic_cast<const dialect_sql *>(&cmd);
+    _latest_sql = dialect ? dialect->expanded_text() : cmd.get_text();
+    _database.note_activity();
+    const shared_ptr<connection> conn = connection_for(_latest_sql);
+    conn->attach(_database.enclosures_used_by(_latest_sql));
+    unique_ptr<statement> result = quince::make_unique<statement>(
+        conn,
+        _latest_sql,
+        cmd,
+        cmd_outlives_stmt,
+        _database.get_statement_profiler()
+    );
+    if (query_plan_advisor * const advisor = _database.get_query_plan_advisor())
+        advisor->examine(result->get_connection()->handle(), _latest_sql);
+    return result;
+}
+
+void
+session_impl::with_writer(const std::function<void(connection &)> &fn) {
+    const shared_ptr<connection> conn = checkout(true);
+
+    conn->exec("SAVEPOINT quince_sqlite_with_writer");
+    try {
+        fn(*conn);
+    }
+    catch (...) {
+        conn->exec("ROLLBACK TO quince_sqlite_with_writer");
+        conn->exec("RELEASE quince_sqlite_with_writer");
+        throw;
+    }
+    conn->exec("RELEASE quince_sqlite_with_writer");
+}
+
+shared_ptr<connection>
+session_impl::connection_for(const string &sql_text) {
+    return checkout(! reads_only(sql_text));
+}
+
+// While our result streams hold a reader, it stays in one read transaction, so once we have
+// written, its snapshot is older than our own write.  Until those streams are done, our reads
+// go to the writer instead, which sees everything.
+//
+shared_ptr<connection>
+session_impl::checkout(bool writable) {
+    if (! _pool)  return _dedicated;
+    if (_writer)  return _writer;
+    if (writable) {
+        _reader_is_stale = ! _reader.expired();
+        return acquire_writer();
+    }
+
+    shared_ptr<connection> result = _reader.lock();
+    if (result  &&  _reader_is_stale)  return acquire_writer();
+    if (! result) {
+        _reader_is_stale = false;
+        _reader = result = _pool->acquire_reader();
+    }
+    return result;
+}
+
+// A result stream, or anything else that we hand out, may hold the writer after we have
+// finished with it.  Then we keep using the same lease, instead of waiting for ourselves.
+//
+shared_ptr<connection>
+session_impl::acquire_writer() {
+    shared_ptr<connection> result = _writer_lease.lock();
+    if (! result)  _writer_lease = result = _pool->acquire_writer();
+    return result;
+}
+
+// Called once a statement has been stepped to completion.  For a pooled session, that's when
+// we find out whether a transaction is open on the writer, in which case we must keep it for
+// the rest of the transaction.  And while we have the writer, its last insert rowid is ours,
+// so we take a copy before someone else gets the chance to change it.
+//
+void
+session_impl::after_step(const statement &stmt) {
+    const shared_ptr<connection> &conn = stmt.get_connection();
+    if (conn->is_read_only())  return;
+
+    _last_insert_rowid = sqlite3_last_insert_rowid(conn->handle());
+    if (_pool)
+        _writer = sqlite3_get_autocommit(conn->handle()) ? nullptr : conn;
 }
 
 }
@@ -0,0 +1,172 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <ctype.h>
+#include <stdio.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <quince_sqlite/detail/statement_profiler.h>
+
+using std::map;
+using std::pair;
+using std::string;
+using std::vector;
+
+
+namespace quince_sqlite {
+
+namespace {
+    // So that the memo can't grow without bound if a client's SQL is full of literals.
+    //
+    const size_t max_normalized_memo_size = 10000;
+
+    // Characters after which a digit is part of a name or a placeholder, not a literal.
+    //
+    bool
+    continues_token(char c) {
+        return isalnum(static_cast<unsigned char>(c))  ||  c == '_'  ||  c == '$'  ||  c == '?';
+    }
+
+    // JSON doesn't allow control characters raw, so those without a short escape, e.g. a form
+    // feed in a literal, are written as \u00XX.  Bytes from 0x80 up are left alone, as parts
+    // of UTF-8.
+    //
+    void
+    write_json_string(std::ostream &os, const string &s) {
+        os << '"';
+        for (const char c: s)
+            switch (c) {
+                case '"':   os << "\\\"";  break;
+                case '\\':  os << "\\\\";  break;
+                case '\n':  os << "\\n";   break;
+                case '\r':  os << "\\r";   break;
+                case '\t':  os << "\\t";   break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20) {
+                        char escape[7];
+                        snprintf(escape, sizeof(escape), "\\u%04x", static_cast<unsigned char>(c));
+                        os << escape;
+                    }
+                    else
+                        os << c;
+            }
+        os << '"';
+    }
+}
+
+
+void
+statement_profiler::record(const string &sql_text, const statement_sample &sample) {
+    const std::lock_guard<std::mutex> lock(_mutex);
+
+    auto memo = _normalized.find(sql_text);
+    if (memo == _normalized.end()) {
+        if (_normalized.size() >= max_normalized_memo_size)  _normalized.clear();
+        memo = _normalized.emplace(sql_text, normalize(sql_text)).first;
+    }
+
+    statement_profile &p = _profiles[memo->second];
+    p._calls++;
+    if (sample._prepared)  p._prepares++;
+    p._prepare_microseconds += sample._prepare_microseconds;
+    p._step_microseconds.record(sample._step_microseconds);
+    p._rows += sample._rows;
+    p._fullscan_steps += sample._fullscan_steps;
+    p._sorts += sample._sorts;
+    p._autoindexes += sample._autoindexes;
+    p._vm_steps += sample._vm_steps;
+}
+
+map<string, statement_profile>
+statement_profiler::get_profiles() const {
+    const std::lock_guard<std::mutex> lock(_mutex);
+    return map<string, statement_profile>(_profiles.begin(), _profiles.end());
+}
+
+void
+statement_profiler::write_json(std::ostream &os) const {
+    vector<pair<string, statement_profile>> profiles;
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        profiles.assign(_profiles.begin(), _profiles.end());
+    }
+    std::sort(profiles.begin(), profiles.end(), [](const pair<string, statement_profile> &a, const pair<string, statement_profile> &b) {
+        return a.second._step_microseconds.total() > b.second._step_microseconds.total();
+    });
+
+    os << "[";
+    const char *separator = "";
+    for (const pair<string, statement_profile> &entry: profiles) {
+        const statement_profile &p = entry.second;
+        os << separator << "{\"sql\":";
+        write_json_string(os, entry.first);
+        os << ",\"calls\":" << p._calls
+           << ",\"prepares\":" << p._prepares
+           << ",\"prepare_microseconds\":" << p._prepare_microseconds
+           << ",\"step_microseconds\":";
+        p._step_microseconds.write_json(os);
+        os << ",\"rows\":" << p._rows
+           << ",\"fullscan_steps\":" << p._fullscan_steps
+           << ",\"sorts\":" << p._sorts
+           << ",\"autoindexes\":" << p._autoindexes
+           << ",\"vm_steps\":" << p._vm_steps
+           << "}";
+        separator = ",";
+    }
+    os << "]";
+}
+
+void
+statement_profiler::clear() {
+    const std::lock_guard<std::mutex> lock(_mutex);
+    _profiles.clear();
+}
+
+string
+statement_profiler::normalize(const string &sql_text) {
+    string result;
+    result.reserve(sql_text.size());
+
+    size_t i = 0;
+    while (i < sql_text.size()) {
+        const char c = sql_text[i];
+        if (c == '\'') {
+            // A string literal, in which '' stands for one quote.
+            //
+            for (i++; i < sql_text.size(); i++)
+                if (sql_text[i] == '\'') {
+                    if (i + 1 < sql_text.size()  &&  sql_text[i + 1] == '\'')  i++;
+                    else                                                      break;
+                }
+            i++;
+            result += '?';
+        }
+        else if (c == '"') {
+            // A quoted identifier, which we keep as is.
+            //
+            const size_t end = std::min(sql_text.find('"', i + 1), sql_text.size() - 1);
+            result.append(sql_text, i, end + 1 - i);
+            i = end + 1;
+        }
+        else if (isdigit(static_cast<unsigned char>(c))  &&  (result.empty()  ||  ! continues_token(result.back()))) {
+            while (i < sql_text.size()  &&  (isalnum(static_cast<unsigned char>(sql_text[i]))  ||  sql_text[i] == '.'))
+                i++;
+            result += '?';
+        }
+        else if (isspace(static_cast<unsigned char>(c))) {
+            while (i < sql_text.size()  &&  isspace(static_cast<unsigned char>(sql_text[i])))  i++;
+            if (! result.empty())  result += ' ';
+        }
+        else {
+            result += c;
+            i++;
+        }
+    }
+    if (! result.empty()  &&  result.back() == ' ')  result.erase(result.size() - 1);
+    return result;
+}
+
+}
@@ -0,0 +1,127 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Reads and writes byte_vector values a chunk at a time through blob handles, and checks the
+// results against what quince reads back whole.  Built and run by `b2 blob-test`.
+//
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <quince/quince.h>
+#include <quince_sqlite/blob.h>
+#include <quince_sqlite/database.h>
+#include "check.h"
+
+using namespace quince_sqlite_test;
+using std::string;
+using std::vector;
+
+
+struct artefact {
+    quince::serial id;
+    vector<uint8_t> payload;
+};
+QUINCE_MAP_CLASS(artefact, (id)(payload))
+
+
+namespace {
+    vector<uint8_t>
+    pattern(size_t size, uint8_t seed) {
+        vector<uint8_t> result(size);
+        for (size_t i = 0; i < size; i++)  result[i] = uint8_t(i * 31 + seed);
+        return result;
+    }
+
+    vector<uint8_t>
+    whole_payload(const quince::serial_table<artefact> &artefacts, const quince::serial &id) {
+        for (const artefact &a: artefacts.where(artefacts->id == id))  return a.payload;
+        return vector<uint8_t>();
+    }
+
+    template<typename Fn>
+    bool
+    throws_dbms_exception(Fn fn) {
+        try {
+            fn();
+            return false;
+        }
+        catch (const quince::dbms_exception &) {
+            return true;
+        }
+    }
+}
+
+
+int
+main() {
+    const boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(dir);
+
+    try {
+        const quince_sqlite::database db((dir / "blob.db").string());
+        quince::serial_table<artefact> artefacts(db, "artefacts", &artefact::id);
+        artefacts.open();
+        const quince::binomen table = { boost::none, "artefacts" };
+        const size_t chunk = 100;
+
+        const quince::serial first = artefacts.insert({ quince::serial(), pattern(1000, 1) });
+        const quince::serial second = artefacts.insert({ quince::serial(), pattern(300, 2) });
+        {
+            quince_sqlite::blob handle(db, table, "payload", first.value());
+            check(handle.size() == 1000, "the handle knows the value's size");
+            vector<uint8_t> read_back(handle.size());
+            for (size_t offset = 0; offset < read_back.size(); offset += chunk)
+                handle.read(&read_back[offset], chunk, offset);
+            check(read_back == pattern(1000, 1), "a value read in chunks is the value");
+
+            handle.reopen(second.value());
+            check(handle.size() == 300, "a reopened handle is on the other record");
+            vector<uint8_t> tail(chunk);
+            handle.read(tail.data(), chunk, 200);
+            const vector<uint8_t> expected = pattern(300, 2);
+            check(tail == vector<uint8_t>(expected.begin() + 200, expected.end()), "a chunk from the middle");
+            check(
+                throws_dbms_exception([&] { handle.read(tail.data(), chunk, 250); }),
+                "a read past the end of the value is refused"
+            );
+        }
+
+        // Storing a new value of a new size: preallocate, then write in chunks.
+        //
+        const vector<uint8_t> replacement = pattern(2000, 3);
+        quince_sqlite::blob::preallocate(db, table, "payload", second.value(), replacement.size());
+        check(whole_payload(artefacts, second) == vector<uint8_t>(replacement.size(), 0), "a preallocated value is all zeroes");
+        {
+            quince_sqlite::blob handle(db, table, "payload", second.value(), true);
+            for (size_t offset = 0; offset < replacement.size(); offset += chunk)
+                handle.write(&replacement[offset], chunk, offset);
+            check(
+                throws_dbms_exception([&] { handle.write(replacement.data(), chunk, replacement.size()); }),
+                "a write can't make the value longer"
+            );
+        }
+        check(whole_payload(artefacts, second) == replacement, "a value written in chunks is the value");
+        check(whole_payload(artefacts, first) == pattern(1000, 1), "and the other record is untouched");
+
+        check(
+            throws_dbms_exception([&] { quince_sqlite::blob::preallocate(db, table, "payload", second.value() + 100, 10); }),
+            "preallocating in a record that doesn't exist is refused"
+        );
+        check(
+            throws_dbms_exception([&] { quince_sqlite::blob missing(db, table, "payload", second.value() + 100); }),
+            "so is opening a handle on one"
+        );
+    }
+    catch (const std::exception &e) {
+        check(false, string("no exception, but got: ") + e.what());
+    }
+
+    boost::system::error_code ignored;
+    boost::filesystem::remove_all(dir, ignored);
+
+    return report("blob_test");
+}
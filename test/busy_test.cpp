@@ -0,0 +1,101 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Checks the busy policy: a connection that finds the database locked gives up at once by
+// default, otherwise waits no longer than the policy's timeout, gets through if the lock goes
+// away in time, and counts its waits.  Built and run by `b2 busy-test`.
+//
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <boost/filesystem.hpp>
+#include <sqlite3.h>
+#include <quince_sqlite/settings.h>
+#include <quince_sqlite/detail/connection.h>
+#include "check.h"
+
+using namespace quince_sqlite;
+using namespace quince_sqlite_test;
+using std::string;
+
+
+namespace {
+    typedef std::chrono::steady_clock clock;
+
+    connection_spec
+    spec(const string &filename, std::chrono::milliseconds timeout, busy_counters *counters) {
+        settings s;
+        s._busy._timeout = timeout;
+        return connection_spec {
+            filename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_PRIVATECACHE, boost::none, s, counters, nullptr
+        };
+    }
+
+    // Tries to take the write lock, and returns the result code of BEGIN IMMEDIATE.
+    //
+    int
+    begin_immediate(connection &conn, std::chrono::milliseconds &elapsed) {
+        sqlite3_stmt *stmt = nullptr;
+        sqlite3_prepare_v2(conn.handle(), "BEGIN IMMEDIATE", -1, &stmt, nullptr);
+        const clock::time_point start = clock::now();
+        const int result = conn.step(stmt, 0);
+        elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - start);
+        sqlite3_finalize(stmt);
+        return result;
+    }
+}
+
+
+int
+main() {
+    const boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(dir);
+    const string filename = (dir / "busy.db").string();
+
+    try {
+        busy_counters counters;
+        counters._waits = 0;
+        counters._blocked_microseconds = 0;
+        std::chrono::milliseconds elapsed;
+
+        connection holder(spec(filename, std::chrono::milliseconds(0), nullptr));
+        holder.exec("CREATE TABLE t(id INTEGER PRIMARY KEY)");
+        holder.exec("BEGIN IMMEDIATE");
+
+        connection impatient(spec(filename, std::chrono::milliseconds(0), &counters));
+        check(begin_immediate(impatient, elapsed) == SQLITE_BUSY, "with the default policy, a locked database is busy");
+        check(elapsed < std::chrono::milliseconds(100), "and we don't wait for it");
+        check(counters.get_statistics()._waits == 0, "so no wait is counted");
+
+        connection patient(spec(filename, std::chrono::milliseconds(200), &counters));
+        check(begin_immediate(patient, elapsed) == SQLITE_BUSY, "a lock that outlasts the timeout makes us give up");
+        check(elapsed >= std::chrono::milliseconds(150), "but only after waiting");
+        check(elapsed < std::chrono::milliseconds(1000), "for about the timeout");
+        const busy_statistics after_timeout = counters.get_statistics();
+        check(after_timeout._waits == 1, "one wait is counted");
+        check(after_timeout._total_blocked_seconds > 0.1, "and the time spent in it");
+
+        connection persistent(spec(filename, std::chrono::milliseconds(5000), &counters));
+        std::thread release([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            holder.exec("COMMIT");
+        });
+        const int result = begin_immediate(persistent, elapsed);
+        release.join();
+        check(result == SQLITE_DONE, "a lock that goes away within the timeout is waited out");
+        check(elapsed < std::chrono::milliseconds(2000), "without waiting for the whole timeout");
+        check(counters.get_statistics()._waits == 2, "and that wait is counted too");
+        persistent.exec("COMMIT");
+    }
+    catch (const std::exception &e) {
+        check(false, string("no exception, but got: ") + e.what());
+    }
+
+    boost::system::error_code ignored;
+    boost::filesystem::remove_all(dir, ignored);
+
+    return report("busy_test");
+}
@@ -0,0 +1,129 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Runs statements on a connection that captures changes, and checks what reaches the change
+// feed: what committed transactions changed, nothing from rolled-back ones, and changesets that
+// reproduce the changes on a replica.  Built and run by `b2 change-feed-test`.
+//
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sqlite3.h>
+#include <quince_sqlite/settings.h>
+#include <quince_sqlite/detail/change_feed.h>
+#include <quince_sqlite/detail/connection.h>
+#include "check.h"
+
+using namespace quince_sqlite;
+using namespace quince_sqlite_test;
+using std::string;
+using std::vector;
+
+
+namespace {
+    // Runs sql_text through connection::step(), the way a session does.
+    //
+    void
+    step_to_completion(connection &conn, const char *sql_text) {
+        sqlite3_stmt *stmt = nullptr;
+        check(sqlite3_prepare_v2(conn.handle(), sql_text, -1, &stmt, nullptr) == SQLITE_OK, string("prepared ") + sql_text);
+        uint64_t rows = 0;
+        int result_code;
+        while ((result_code = conn.step(stmt, rows)) == SQLITE_ROW)  rows++;
+        check(result_code == SQLITE_DONE, string("ran ") + sql_text);
+        sqlite3_finalize(stmt);
+    }
+
+    connection_spec
+    spec(const string &filename, change_feed *feed) {
+        settings s;
+        s._change_capture = change_capture::feed_and_changesets;
+        return connection_spec {
+            filename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI | SQLITE_OPEN_PRIVATECACHE,
+            boost::none, s, nullptr, feed
+        };
+    }
+}
+
+
+int
+main() {
+    try {
+        change_feed feed;
+        vector<committed_changes> published;
+        feed.subscribe([&](const committed_changes &c) { published.push_back(c); });
+
+        connection conn(spec("file:change_feed_test_source?mode=memory", &feed));
+        connection replica(spec("file:change_feed_test_replica?mode=memory", nullptr));
+        for (connection *c: { &conn, &replica })
+            c->exec("CREATE TABLE t(id INTEGER PRIMARY KEY, v INTEGER)");
+        published.clear();
+
+        conn.exec("INSERT INTO t(v) VALUES (1)");
+        check(published.size() == 1, "an autocommit insert is published");
+        check(published.size() == 1  &&  published[0]._changes.size() == 1, "with its one change");
+        check(
+            published.size() == 1  &&  published[0]._changes.size() == 1
+                && published[0]._changes[0]._operation == change_operation::insert
+                && published[0]._changes[0]._table._local == "t"
+                && published[0]._changes[0]._rowid == 1,
+            "as an insert into t of rowid 1"
+        );
+
+        published.clear();
+        step_to_completion(conn, "WITH n(x) AS (VALUES (2), (3)) INSERT INTO t(v) SELECT x FROM n");
+        check(published.size() == 1  &&  published[0]._changes.size() == 2, "a WITH ... INSERT is published");
+        check(published.size() == 1  &&  ! published[0]._changeset.empty(), "a WITH ... INSERT has a changeset");
+
+        published.clear();
+        conn.exec("WITH n(x) AS (VALUES (4)) INSERT INTO t(v) SELECT x FROM n");
+        check(published.size() == 1  &&  ! published[0]._changeset.empty(), "a WITH ... INSERT run by exec() has a changeset");
+
+        published.clear();
+        step_to_completion(conn, "SELECT * FROM t");
+        step_to_completion(conn, "WITH n(x) AS (VALUES (1)) SELECT x FROM n");
+        check(published.empty(), "reads publish nothing");
+
+        conn.exec("BEGIN");
+        conn.exec("UPDATE t SET v = v + 10");
+        conn.exec("ROLLBACK");
+        check(published.empty(), "a rolled-back transaction publishes nothing");
+
+        conn.exec("BEGIN");
+        conn.exec("DELETE FROM t WHERE id = 1");
+        conn.exec("SAVEPOINT s");
+        conn.exec("DELETE FROM t WHERE id = 2");
+        conn.exec("ROLLBACK TO s");
+        conn.exec("RELEASE s");
+        check(published.empty(), "nothing is published before the commit");
+        conn.exec("COMMIT");
+        check(published.size() == 1  &&  published[0]._changes.size() == 1, "changes rolled back to a savepoint are dropped");
+        check(
+            published.size() == 1  &&  published[0]._changes.size() == 1
+                && published[0]._changes[0]._operation == change_operation::remove
+                && published[0]._changes[0]._rowid == 1,
+            "and the change that stayed is the delete of rowid 1"
+        );
+
+        // The replica starts with the same rows, and the changeset of an update brings it level.
+        //
+        const string dump = "SELECT group_concat(id || ':' || v, ',') FROM (SELECT * FROM t ORDER BY id)";
+        replica.exec("INSERT INTO t(id, v) VALUES (2, 2), (3, 3), (4, 4)");
+        check(single_value(replica.handle(), dump.c_str()) == single_value(conn.handle(), dump.c_str()), "the replica starts level");
+
+        published.clear();
+        conn.exec("UPDATE t SET v = v * 100");
+        check(published.size() == 1  &&  ! published[0]._changeset.empty(), "an update has a changeset");
+        if (published.size() == 1)
+            apply_changeset(replica.handle(), published[0]._changeset, changeset_conflict::abort);
+        check(single_value(replica.handle(), dump.c_str()) == single_value(conn.handle(), dump.c_str()), "the changeset brings the replica level");
+    }
+    catch (const std::exception &e) {
+        check(false, string("no exception, but got: ") + e.what());
+    }
+
+    return report("change_feed_test");
+}
@@ -0,0 +1,56 @@
+#ifndef QUINCE_SQLITE__test__check_h
+#define QUINCE_SQLITE__test__check_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <iostream>
+#include <string>
+#include <sqlite3.h>
+
+
+// What each test program shares: a count of failed checks, which becomes its exit status, and
+// a way to look at the database without going through the code under test.
+//
+namespace quince_sqlite_test {
+
+inline int &
+failures() {
+    static int result = 0;
+    return result;
+}
+
+inline void
+check(bool condition, const std::string &what) {
+    if (! condition) {
+        std::cerr << "FAILED: " << what << "\n";
+        failures()++;
+    }
+}
+
+// The first column of the first row that sql_text produces, as text, or "" if there is none.
+//
+inline std::string
+single_value(sqlite3 *conn, const std::string &sql_text) {
+    sqlite3_stmt *stmt = nullptr;
+    std::string result;
+    if (sqlite3_prepare_v2(conn, sql_text.c_str(), -1, &stmt, nullptr) == SQLITE_OK  &&  sqlite3_step(stmt) == SQLITE_ROW)
+        if (const unsigned char * const text = sqlite3_column_text(stmt, 0))
+            result = reinterpret_cast<const char *>(text);
+    sqlite3_finalize(stmt);
+    return result;
+}
+
+// Returns the exit status for main().
+//
+inline int
+report(const std::string &test_name) {
+    if (failures() == 0)  std::cout << test_name << " passed\n";
+    return failures() == 0 ? 0 : 1;
+}
+
+}
+
+#endif
@@ -0,0 +1,121 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Checks combinations (UNION, INTERSECT, EXCEPT) whose right-hand sides are combinations
+// themselves, and, on SQLite 3.39 and later, right and full joins.  Built and run by
+// `b2 combination-test`.
+//
+
+#include <stdint.h>
+#include <algorithm>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <quince/quince.h>
+#include <quince_sqlite/database.h>
+#include <quince_sqlite/detail/connection.h>
+#include "check.h"
+
+using namespace quince_sqlite_test;
+using std::string;
+using std::vector;
+
+
+struct number {
+    quince::serial id;
+    int64_t n;
+};
+QUINCE_MAP_CLASS(number, (id)(n))
+
+struct owner {
+    quince::serial id;
+    string name;
+};
+QUINCE_MAP_CLASS(owner, (id)(name))
+
+struct pet {
+    quince::serial id;
+    quince::serial owner_id;
+    string name;
+};
+QUINCE_MAP_CLASS(pet, (id)(owner_id)(name))
+
+
+namespace {
+    vector<int64_t>
+    sorted(const quince::query<int64_t> &q) {
+        vector<int64_t> result;
+        for (const int64_t n: q)  result.push_back(n);
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+}
+
+
+int
+main() {
+    const boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(dir);
+
+    try {
+        const quince_sqlite::database db((dir / "combination.db").string());
+        quince::serial_table<number> numbers(db, "numbers", &number::id);
+        numbers.open();
+        for (int64_t n = 1; n <= 6; n++)  numbers.insert({ quince::serial(), n });
+
+        const quince::query<int64_t> low = numbers.where(numbers->n <= 4).select(numbers->n);          // 1 2 3 4
+        const quince::query<int64_t> high = numbers.where(numbers->n >= 3).select(numbers->n);         // 3 4 5 6
+        const quince::query<int64_t> middle = numbers.where(numbers->n == 4  ||  numbers->n == 5).select(numbers->n);  // 4 5
+
+        check(sorted(low.intersect(high)) == vector<int64_t>({ 3, 4 }), "INTERSECT");
+        check(sorted(low.except(high)) == vector<int64_t>({ 1, 2 }), "EXCEPT");
+        check(sorted(low.union_(high.intersect(middle))) == vector<int64_t>({ 1, 2, 3, 4, 5 }), "UNION of an INTERSECT");
+        check(sorted(low.except(high.except(middle))) == vector<int64_t>({ 1, 2, 4 }), "EXCEPT of an EXCEPT");
+        check(sorted(middle.union_all(middle.union_all(middle))) == vector<int64_t>({ 4, 4, 4, 5, 5, 5 }), "UNION ALL of a UNION ALL");
+        check(
+            sorted(low.intersect(high.union_(middle.except(low)))) == vector<int64_t>({ 3, 4 }),
+            "a combination nested two deep"
+        );
+
+        if (quince_sqlite::sqlite_version_at_least(3039000)) {
+            quince::serial_table<owner> owners(db, "owners", &owner::id);
+            owners.open();
+            quince::serial_table<pet> pets(db, "pets", &pet::id);
+            pets.open();
+
+            const quince::serial ann = owners.insert({ quince::serial(), "ann" });
+            owners.insert({ quince::serial(), "bob" });
+            pets.insert({ quince::serial(), ann, "rex" });
+            quince::serial nobody;
+            nobody.assign(ann.value() + 100);
+            pets.insert({ quince::serial(), nobody, "stray" });
+
+            size_t rows = 0, unowned = 0;
+            for (const auto &row: quince::right_join(owners, pets, owners->id == pets->owner_id)) {
+                rows++;
+                if (! std::get<0>(row))  unowned++;
+            }
+            check(rows == 2  &&  unowned == 1, "a right join keeps every pet, owned or not");
+
+            rows = 0, unowned = 0;
+            size_t petless = 0;
+            for (const auto &row: quince::full_join(owners, pets, owners->id == pets->owner_id)) {
+                rows++;
+                if (! std::get<0>(row))  unowned++;
+                if (! std::get<1>(row))  petless++;
+            }
+            check(rows == 3  &&  unowned == 1  &&  petless == 1, "a full join keeps every owner and every pet");
+        }
+    }
+    catch (const std::exception &e) {
+        check(false, string("no exception, but got: ") + e.what());
+    }
+
+    boost::system::error_code ignored;
+    boost::filesystem::remove_all(dir, ignored);
+
+    return report("combination_test");
+}
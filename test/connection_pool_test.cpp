@@ -0,0 +1,111 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Checks the connection pool: readers are read-only and see the writer's commits, a reader can
+// read while the writer is in a transaction, a second claim on the writer times out, and
+// in-memory databases are refused.  Built and run by `b2 connection-pool-test`.
+//
+
+#include <memory>
+#include <string>
+#include <boost/filesystem.hpp>
+#include <quince/exceptions.h>
+#include <sqlite3.h>
+#include <quince_sqlite/settings.h>
+#include <quince_sqlite/detail/connection_pool.h>
+#include "check.h"
+
+using namespace quince_sqlite;
+using namespace quince_sqlite_test;
+using std::shared_ptr;
+using std::string;
+
+
+namespace {
+    connection_spec
+    spec(const string &filename) {
+        settings s;
+        s._pooled_readers = 2;
+        s._busy._timeout = std::chrono::milliseconds(100);
+        return connection_spec { filename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, boost::none, s, nullptr, nullptr };
+    }
+
+    bool
+    refuses(const string &filename) {
+        try {
+            connection_pool pool(spec(filename));
+            return false;
+        }
+        catch (const quince::unsupported_exception &) {
+            return true;
+        }
+    }
+}
+
+
+int
+main() {
+    const boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(dir);
+    const string filename = (dir / "pool.db").string();
+
+    try {
+        connection_pool pool(spec(filename));
+        {
+            const shared_ptr<connection> writer = pool.acquire_writer();
+            check(! writer->is_read_only(), "the writer can write");
+            check(single_value(writer->handle(), "PRAGMA journal_mode") == "wal", "the pool is in WAL mode");
+            writer->exec("CREATE TABLE t(v INTEGER)");
+            writer->exec("INSERT INTO t VALUES (1)");
+        }
+        {
+            const shared_ptr<connection> reader = pool.acquire_reader();
+            check(reader->is_read_only(), "a reader is read-only");
+            check(single_value(reader->handle(), "SELECT sum(v) FROM t") == "1", "a reader sees the writer's commits");
+        }
+        {
+            const shared_ptr<connection> writer = pool.acquire_writer();
+            writer->exec("BEGIN");
+            writer->exec("INSERT INTO t VALUES (2)");
+
+            const shared_ptr<connection> first = pool.acquire_reader();
+            const shared_ptr<connection> second = pool.acquire_reader();
+            check(first != second, "each reader is checked out once");
+            check(single_value(first->handle(), "SELECT sum(v) FROM t") == "1", "readers read alongside an open write transaction");
+
+            bool timed_out = false;
+            try {
+                pool.acquire_writer();
+            }
+            catch (const quince::deadlock_exception &) {
+                timed_out = true;
+            }
+            check(timed_out, "a second claim on the writer times out");
+        }
+        {
+            // Giving the writer back mid-transaction rolled the transaction back.
+            //
+            const shared_ptr<connection> writer = pool.acquire_writer();
+            check(sqlite3_get_autocommit(writer->handle()) != 0, "a returned writer is out of its transaction");
+            check(single_value(writer->handle(), "SELECT sum(v) FROM t") == "1", "and what it didn't commit is gone");
+        }
+
+        const connection_pool_statistics statistics = pool.get_statistics();
+        check(statistics._readers == 2  &&  statistics._writers == 1, "the pool has the connections it was asked for");
+        check(statistics._checkouts == 6  &&  statistics._waits == 1, "checkouts and waits are counted");
+
+        check(refuses(":memory:"), "\":memory:\" is refused");
+        check(refuses(""), "a temporary database is refused");
+        check(refuses("file:pool?mode=memory&cache=shared"), "a URI in-memory database is refused");
+    }
+    catch (const std::exception &e) {
+        check(false, string("no exception, but got: ") + e.what());
+    }
+
+    boost::system::error_code ignored;
+    boost::filesystem::remove_all(dir, ignored);
+
+    return report("connection_pool_test");
+}
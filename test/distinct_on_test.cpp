@@ -0,0 +1,102 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Runs "first row per group" queries, i.e. DISTINCT ON, which SQLite 3.25 and later runs with
+// a ROW_NUMBER() window, and checks that only the first row of each group comes back, in
+// order, and that the window's own columns don't.  Built and run by `b2 distinct-on-test`.
+//
+
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <quince/quince.h>
+#include <sqlite3.h>
+#include <quince_sqlite/database.h>
+#include <quince_sqlite/detail/connection.h>
+#include "check.h"
+
+using namespace quince_sqlite_test;
+using std::pair;
+using std::string;
+using std::vector;
+
+
+struct reading {
+    quince::serial id;
+    int64_t device;
+    int64_t value;
+};
+QUINCE_MAP_CLASS(reading, (id)(device)(value))
+
+
+namespace {
+    typedef vector<pair<int64_t, int64_t>> device_values;
+
+    device_values
+    device_values_of(const quince::query<reading> &q) {
+        device_values result;
+        for (const reading &r: q)  result.push_back({ r.device, r.value });
+        return result;
+    }
+}
+
+
+int
+main() {
+    if (! quince_sqlite::sqlite_version_at_least(3025000)) {
+        std::cout << "distinct_on_test skipped: SQLite " << sqlite3_libversion() << " has no window functions\n";
+        return 0;
+    }
+
+    const boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(dir);
+
+    try {
+        const quince_sqlite::database db((dir / "distinct_on.db").string());
+        quince::serial_table<reading> readings(db, "readings", &reading::id);
+        readings.open();
+        for (const pair<int64_t, int64_t> &dv: device_values { { 1, 5 }, { 2, 7 }, { 1, 3 }, { 3, 4 }, { 2, 2 }, { 1, 9 } })
+            readings.insert({ quince::serial(), dv.first, dv.second });
+
+        const quince::query<reading> lowest =
+            readings.distinct(readings->device).order(readings->device, readings->value);
+        check(device_values_of(lowest) == device_values({ { 1, 3 }, { 2, 2 }, { 3, 4 } }), "the lowest value per device");
+
+        check(
+            device_values_of(lowest.limit(2)) == device_values({ { 1, 3 }, { 2, 2 } }),
+            "a limit counts groups, not rows"
+        );
+        check(
+            device_values_of(readings.where(readings->value > 3).distinct(readings->device).order(readings->device, readings->value))
+                == device_values({ { 1, 5 }, { 2, 7 }, { 3, 4 } }),
+            "the where() condition applies before the groups are formed"
+        );
+
+        vector<int64_t> values;
+        for (const int64_t v: lowest.select(readings->value))  values.push_back(v);
+        check(values == vector<int64_t>({ 3, 2, 4 }), "a projection of the first rows");
+
+        // If the window's columns leaked out, the two sides of the UNION would have different
+        // numbers of columns, and SQLite would refuse it.
+        //
+        size_t combined = 0;
+        for (const reading &r: lowest.union_(readings.where(readings->device == 3))) {
+            combined++;
+            check(r.device != 3  ||  r.value == 4, "a row from either side");
+        }
+        check(combined == 3, "a DISTINCT ON query in a UNION");
+    }
+    catch (const std::exception &e) {
+        check(false, string("no exception, but got: ") + e.what());
+    }
+
+    boost::system::error_code ignored;
+    boost::filesystem::remove_all(dir, ignored);
+
+    return report("distinct_on_test");
+}
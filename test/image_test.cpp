@@ -0,0 +1,64 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Saves an image of a WAL-mode database, loads it into shared memory, and checks that a
+// read-only connection to the loaded image sees the data.  Built and run by `b2 image-test`.
+//
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <boost/filesystem.hpp>
+#include <sqlite3.h>
+#include <quince_sqlite/settings.h>
+#include <quince_sqlite/detail/connection.h>
+#include <quince_sqlite/detail/image.h>
+#include "check.h"
+
+using namespace quince_sqlite;
+using namespace quince_sqlite_test;
+using std::string;
+
+
+namespace {
+    connection_spec
+    spec(const string &filename, int flags, const settings &s = settings()) {
+        return connection_spec { filename, flags, boost::none, s, nullptr, nullptr };
+    }
+}
+
+
+int
+main() {
+    const boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(dir);
+    const string db_filename = (dir / "wal.db").string();
+    const string image_filename = (dir / "wal.image").string();
+
+    try {
+        settings wal;
+        wal._tuning._journal_mode = journal_mode::wal;
+        {
+            connection source(spec(db_filename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_PRIVATECACHE, wal));
+            source.exec("CREATE TABLE t(id INTEGER PRIMARY KEY, v TEXT)");
+            source.exec("INSERT INTO t(v) VALUES ('a'), ('b'), ('c')");
+            check(single_value(source.handle(), "PRAGMA journal_mode") == "wal", "source is in WAL mode");
+            save_image(source.handle(), "main", image_filename);
+        }
+
+        const string uri = new_memdb_uri();
+        const std::unique_ptr<connection> holder = load_image(image_filename, uri);
+        connection reader(spec(uri, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI));
+        check(single_value(reader.handle(), "SELECT count(*) FROM t") == "3", "loaded image has the rows");
+    }
+    catch (const std::exception &e) {
+        check(false, string("no exception, but got: ") + e.what());
+    }
+
+    boost::system::error_code ignored;
+    boost::filesystem::remove_all(dir, ignored);
+
+    return report("image_test");
+}
@@ -0,0 +1,108 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Creates an index on an expression and a unique partial index, checks what SQLite made of
+// them, and checks that the partial index's uniqueness only applies to the rows it covers.
+// Built and run by `b2 partial-index-test`.
+//
+
+#include <stdint.h>
+#include <string>
+#include <boost/filesystem.hpp>
+#include <quince/quince.h>
+#include <sqlite3.h>
+#include <quince_sqlite/database.h>
+#include "check.h"
+
+using namespace quince_sqlite_test;
+using std::string;
+
+
+struct person {
+    quince::serial id;
+    string name;
+    bool active;
+    int64_t born;
+    int64_t died;
+};
+QUINCE_MAP_CLASS(person, (id)(name)(active)(born)(died))
+
+
+namespace {
+    template<typename Fn>
+    bool
+    throws_dbms_exception(Fn fn) {
+        try {
+            fn();
+            return false;
+        }
+        catch (const quince::dbms_exception &) {
+            return true;
+        }
+    }
+}
+
+
+int
+main() {
+    const boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(dir);
+    const string filename = (dir / "partial_index.db").string();
+
+    try {
+        const quince_sqlite::database db(filename);
+        quince::serial_table<person> people(db, "people", &person::id);
+        people.specify_index(people->born + people->died);
+        people.open();
+
+        db.create_partial_index(people.get_binomen(), "active_people_by_name", { &people->name }, people->active, true);
+        db.create_partial_index(people.get_binomen(), "active_people_by_name", { &people->name }, people->active, true);
+
+        bool refused = false;
+        try {
+            db.create_partial_index(people.get_binomen(), "adults", { &people->name }, people->born < int64_t(2000));
+        }
+        catch (const quince::unsupported_exception &) {
+            refused = true;
+        }
+        check(refused, "a predicate with a constant in it is refused");
+
+        sqlite3 *inspector = nullptr;
+        sqlite3_open_v2(filename.c_str(), &inspector, SQLITE_OPEN_READONLY | SQLITE_OPEN_PRIVATECACHE, nullptr);
+        check(
+            single_value(inspector, "SELECT count(*) FROM sqlite_master WHERE type = 'index' AND tbl_name = 'people' AND sql LIKE '%+%'") == "1",
+            "the expression index was created"
+        );
+        check(
+            single_value(inspector, "SELECT sql FROM sqlite_master WHERE name = 'active_people_by_name'").find(" WHERE ") != string::npos,
+            "the partial index was created, with its predicate"
+        );
+        check(
+            single_value(inspector, "SELECT count(*) FROM sqlite_master WHERE name = 'adults'") == "0",
+            "the refused index wasn't created"
+        );
+        sqlite3_close(inspector);
+
+        people.insert({ quince::serial(), "ann", false, 1950, 2010 });
+        people.insert({ quince::serial(), "ann", false, 1960, 2020 });
+        people.insert({ quince::serial(), "ann", true, 1970, 0 });
+        check(
+            throws_dbms_exception([&] { people.insert({ quince::serial(), "ann", true, 1980, 0 }); }),
+            "the partial index is unique among the rows it covers"
+        );
+        size_t found = 0;
+        for (const person &p: people.where(people->born + people->died == int64_t(3960)))
+            found += (p.born == 1950);
+        check(found == 1, "a query on the indexed expression");
+    }
+    catch (const std::exception &e) {
+        check(false, string("no exception, but got: ") + e.what());
+    }
+
+    boost::system::error_code ignored;
+    boost::filesystem::remove_all(dir, ignored);
+
+    return report("partial_index_test");
+}
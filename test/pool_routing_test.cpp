@@ -0,0 +1,114 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Checks how a session with a connection pool routes its statements: writes that look like
+// reads (WITH ... INSERT, PRAGMA assignments) must go to the writer, which the read-only
+// readers would refuse, and a session whose result stream holds the writer must not wait
+// for itself when it writes again.  Built and run by `b2 pool-routing-test`.
+//
+
+#include <stdint.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <boost/filesystem.hpp>
+#include <quince/quince.h>
+#include <quince/detail/row.h>
+#include <quince/detail/session.h>
+#include <quince/detail/sql.h>
+#include <quince_sqlite/database.h>
+#include <quince_sqlite/settings.h>
+#include "check.h"
+
+using namespace quince_sqlite_test;
+using std::string;
+using std::unique_ptr;
+
+
+struct item {
+    quince::serial id;
+    int64_t value;
+};
+QUINCE_MAP_CLASS(item, (id)(value))
+
+
+namespace {
+    unique_ptr<quince::sql>
+    make_sql(const quince_sqlite::database &db, const string &sql_text) {
+        unique_ptr<quince::sql> result = db.make_sql();
+        result->write(sql_text);
+        return result;
+    }
+
+    size_t
+    count(const quince::serial_table<item> &items) {
+        size_t result = 0;
+        for (const item &i: items)  result += (i.value >= 0);
+        return result;
+    }
+
+    size_t
+    drain(const quince::session &session, const quince::result_stream &stream) {
+        size_t result = 0;
+        while (session->next_output(stream))  result++;
+        return result;
+    }
+}
+
+
+int
+main() {
+    const boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(dir);
+
+    try {
+        quince_sqlite::settings s;
+        s._pooled_readers = 2;
+        s._busy._timeout = std::chrono::milliseconds(200);
+        const quince_sqlite::database db(
+            (dir / "pool_routing.db").string(), true, true, false,
+            boost::none, boost::none, quince_sqlite::database::filename_map(), s
+        );
+        check(db.get_connection_pool_statistics()->_readers == 2, "the database has a pool");
+
+        quince::serial_table<item> items(db, "items", &item::id);
+        items.open();
+        items.insert({ quince::serial(), 1 });
+        check(count(items) == 1, "a read sees an earlier insert");
+
+        const quince::session session = db.get_session();
+        session->exec(*make_sql(db, "WITH v(x) AS (SELECT 2) INSERT INTO \"items\"(\"value\") SELECT x FROM v"));
+        check(count(items) == 2, "WITH ... INSERT goes to the writer");
+
+        session->exec(*make_sql(db, "PRAGMA user_version = 7"));
+        const quince::result_stream version = session->exec_with_stream_output(*make_sql(db, "PRAGMA user_version"), 1);
+        const unique_ptr<quince::row> version_row = session->next_output(version);
+        check(version_row != nullptr, "a PRAGMA assignment goes to the writer, and a PRAGMA lookup still reads");
+
+        const unique_ptr<quince::sql> select_all = make_sql(db, "SELECT * FROM \"items\"");
+        const unique_ptr<quince::sql> insert_one = make_sql(db, "INSERT INTO \"items\"(\"value\") VALUES (3)");
+
+        // on_reader holds a reader, so after the insert, that reader is stale, and on_writer is
+        // read from the writer instead.  It then holds the writer, which the second insert
+        // needs too.
+        //
+        const quince::result_stream on_reader = session->exec_with_stream_output(*select_all, 1);
+        check(session->next_output(on_reader) != nullptr, "a stream on a reader");
+        session->exec(*insert_one);
+        const quince::result_stream on_writer = session->exec_with_stream_output(*select_all, 1);
+        check(session->next_output(on_writer) != nullptr, "a stream on the writer");
+        session->exec(*insert_one);
+        check(drain(session, on_writer) >= 2, "the stream on the writer saw the first insert");
+        drain(session, on_reader);
+    }
+    catch (const std::exception &e) {
+        check(false, string("no exception, but got: ") + e.what());
+    }
+
+    boost::system::error_code ignored;
+    boost::filesystem::remove_all(dir, ignored);
+
+    return report("pool_routing_test");
+}
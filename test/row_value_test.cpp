@@ -0,0 +1,95 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Pages through a table with a two-column key by collective comparisons, which SQLite 3.15
+// and later runs as row-value comparisons, and checks each page against the same page found
+// by skipping.  Built and run by `b2 row-value-test`.
+//
+
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <quince/quince.h>
+#include <sqlite3.h>
+#include <quince_sqlite/database.h>
+#include <quince_sqlite/detail/connection.h>
+#include "check.h"
+
+using namespace quince_sqlite_test;
+using std::string;
+using std::vector;
+
+
+struct page_key {
+    int64_t major;
+    int64_t minor;
+};
+QUINCE_MAP_CLASS(page_key, (major)(minor))
+
+struct entry {
+    page_key key;
+    int64_t payload;
+};
+QUINCE_MAP_CLASS(entry, (key)(payload))
+
+
+namespace {
+    vector<int64_t>
+    payloads(const quince::query<entry> &q) {
+        vector<int64_t> result;
+        for (const entry &e: q)  result.push_back(e.payload);
+        return result;
+    }
+}
+
+
+int
+main() {
+    if (! quince_sqlite::sqlite_version_at_least(3015000)) {
+        std::cout << "row_value_test skipped: SQLite " << sqlite3_libversion() << " has no row values\n";
+        return 0;
+    }
+
+    const boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(dir);
+
+    try {
+        const quince_sqlite::database db((dir / "row_value.db").string());
+        quince::table<entry> entries(db, "entries", &entry::key);
+        entries.open();
+
+        const int64_t minors = 7;
+        for (int64_t major = 0; major < 10; major++)
+            for (int64_t minor = 0; minor < minors; minor++)
+                entries.insert({ { major, minor }, major * minors + minor });
+
+        const uint32_t page = 5;
+        page_key previous = { -1, 0 };
+        for (int64_t depth = 0; depth < 70; depth += page) {
+            const vector<int64_t> by_keyset = payloads(entries.where(entries->key > previous).order(entries->key).limit(page));
+            const vector<int64_t> by_skipping = payloads(entries.order(entries->key).skip(depth).limit(page));
+            check(by_keyset == by_skipping, "the page at depth " + std::to_string(depth));
+            if (by_keyset.empty())  break;
+            previous = { by_keyset.back() / minors, by_keyset.back() % minors };
+        }
+
+        const page_key middle = { 4, 3 };
+        check(payloads(entries.where(entries->key == middle)) == vector<int64_t>{ 31 }, "==");
+        check(payloads(entries.where(entries->key != middle)).size() == 69, "!=");
+        check(payloads(entries.where(entries->key >= middle).order(entries->key).limit(2)) == vector<int64_t>({ 31, 32 }), ">=");
+        check(payloads(entries.where(entries->key < middle).order(entries->key).skip(29)) == vector<int64_t>({ 29, 30 }), "<");
+        check(payloads(entries.where(entries->key <= middle)).size() == 32, "<=");
+    }
+    catch (const std::exception &e) {
+        check(false, string("no exception, but got: ") + e.what());
+    }
+
+    boost::system::error_code ignored;
+    boost::filesystem::remove_all(dir, ignored);
+
+    return report("row_value_test");
+}
@@ -0,0 +1,104 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Checks that a connection's statement cache reuses idle statements, never hands out one that
+// is in use, stays within its capacity, and forgets everything when the schema changes.  Built
+// and run by `b2 statement-cache-test`.
+//
+
+#include <string>
+#include <sqlite3.h>
+#include <quince_sqlite/settings.h>
+#include <quince_sqlite/detail/connection.h>
+#include "check.h"
+
+using namespace quince_sqlite;
+using namespace quince_sqlite_test;
+using std::string;
+
+
+namespace {
+    connection_spec
+    spec(size_t capacity) {
+        settings s;
+        s._statement_cache_capacity = capacity;
+        return connection_spec { ":memory:", SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, boost::none, s, nullptr, nullptr };
+    }
+
+    bool
+    same_statistics(const statement_cache_statistics &s, uint64_t hits, uint64_t misses, uint64_t evictions) {
+        return s._hits == hits  &&  s._misses == misses  &&  s._evictions == evictions;
+    }
+}
+
+
+int
+main() {
+    try {
+        connection conn(spec(2));
+        conn.exec("CREATE TABLE t(id INTEGER PRIMARY KEY, v TEXT)");
+        statement_cache &cache = conn.statements();
+        const string select_all = "SELECT * FROM t";
+        const string select_one = "SELECT v FROM t WHERE id = ?1";
+        const string select_count = "SELECT count(*) FROM t";
+        int result_code;
+        bool was_cached;
+
+        statement_cache::prepared first = cache.acquire(select_all, result_code, was_cached);
+        check(result_code == SQLITE_OK  &&  first._stmt != nullptr  &&  ! was_cached, "a new text is prepared");
+        sqlite3_stmt * const first_stmt = first._stmt;
+
+        statement_cache::prepared second = cache.acquire(select_all, result_code, was_cached);
+        check(! was_cached  &&  second._stmt != first_stmt, "a statement in use is not handed out again");
+
+        cache.release(select_all, std::move(first));
+        cache.release(select_all, std::move(second));
+        statement_cache::prepared third = cache.acquire(select_all, result_code, was_cached);
+        check(was_cached  &&  third._stmt == first_stmt, "a released statement is reused");
+        check(same_statistics(cache.get_statistics(), 1, 2, 0), "one hit, two misses");
+        cache.release(select_all, std::move(third));
+
+        // Capacity 2: the least recently used idle statement goes first.
+        //
+        for (const string &text: { select_one, select_count }) {
+            statement_cache::prepared p = cache.acquire(text, result_code, was_cached);
+            check(result_code == SQLITE_OK, "prepared " + text);
+            cache.release(text, std::move(p));
+        }
+        check(cache.get_statistics()._evictions == 1, "the cache stays within its capacity");
+        cache.acquire(select_all, result_code, was_cached);
+        check(! was_cached, "and the least recently used statement was the one evicted");
+
+        statement_cache::prepared failed = cache.acquire("SELECT * FROM no_such_table", result_code, was_cached);
+        check(result_code != SQLITE_OK  &&  failed._stmt == nullptr, "a statement that doesn't prepare is reported");
+        cache.release("SELECT * FROM no_such_table", std::move(failed));
+
+        // A schema change empties the cache.
+        //
+        conn.exec("CREATE TABLE u(id INTEGER PRIMARY KEY)");
+        statement_cache::prepared create = cache.acquire("CREATE INDEX t_v ON t(v)", result_code, was_cached);
+        check(sqlite3_step(create._stmt) == SQLITE_DONE, "created an index");
+        cache.release("CREATE INDEX t_v ON t(v)", std::move(create));
+        for (const string &text: { select_one, select_count }) {
+            statement_cache::prepared p = cache.acquire(text, result_code, was_cached);
+            check(! was_cached, "a schema change evicts " + text);
+            cache.release(text, std::move(p));
+        }
+
+        // Capacity 0: nothing is kept.
+        //
+        connection uncached(spec(0));
+        for (int i = 0; i < 2; i++) {
+            statement_cache::prepared p = uncached.statements().acquire("SELECT 1", result_code, was_cached);
+            check(! was_cached, "with capacity 0, nothing is reused");
+            uncached.statements().release("SELECT 1", std::move(p));
+        }
+    }
+    catch (const std::exception &e) {
+        check(false, string("no exception, but got: ") + e.what());
+    }
+
+    return report("statement_cache_test");
+}
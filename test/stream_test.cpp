@@ -0,0 +1,92 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Reads result streams with various fetch sizes, i.e. how many rows the session prefetches at
+// a time, and checks that every row arrives once, however the table's size divides into
+// batches.  Also checks the documented catch: rows already prefetched don't see the session's
+// later writes.  Built and run by `b2 stream-test`.
+//
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <boost/filesystem.hpp>
+#include <quince/quince.h>
+#include <quince/detail/session.h>
+#include <quince/detail/sql.h>
+#include <quince_sqlite/database.h>
+#include "check.h"
+
+using namespace quince_sqlite_test;
+using std::string;
+using std::unique_ptr;
+
+
+struct item {
+    quince::serial id;
+    int64_t value;
+};
+QUINCE_MAP_CLASS(item, (id)(value))
+
+
+namespace {
+    unique_ptr<quince::sql>
+    make_sql(const quince_sqlite::database &db, const string &sql_text) {
+        unique_ptr<quince::sql> result = db.make_sql();
+        result->write(sql_text);
+        return result;
+    }
+}
+
+
+int
+main() {
+    const boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(dir);
+
+    try {
+        const quince_sqlite::database db((dir / "stream.db").string());
+        quince::serial_table<item> items(db, "items", &item::id);
+        items.open();
+        const size_t rows = 10;
+        for (size_t i = 0; i < rows; i++)  items.insert({ quince::serial(), int64_t(i) });
+
+        const quince::session session = db.get_session();
+        const unique_ptr<quince::sql> select_all = make_sql(db, "SELECT * FROM \"items\"");
+
+        // 0 is taken to mean 1, and 3 and 7 leave a partial batch at the end.
+        //
+        for (const uint32_t fetch_size: { 0u, 1u, 3u, 7u, 10u, 1000u }) {
+            size_t read = 0;
+            const quince::result_stream stream = session->exec_with_stream_output(*select_all, fetch_size);
+            while (session->next_output(stream))  read++;
+            check(read == rows, "every row once, with fetch_size " + std::to_string(fetch_size));
+            check(! session->next_output(stream), "and then nothing, with fetch_size " + std::to_string(fetch_size));
+        }
+
+        // Once the first row is handed out, the next four are already in the batch, so they
+        // still arrive after the session deletes them.
+        //
+        {
+            const quince::result_stream stream = session->exec_with_stream_output(*select_all, 5);
+            check(session->next_output(stream) != nullptr, "the first row");
+            session->exec(*make_sql(db, "DELETE FROM \"items\""));
+            size_t read = 0;
+            while (session->next_output(stream))  read++;
+            check(read >= 4, "prefetched rows outlive a later delete");
+        }
+        size_t remaining = 0;
+        for (const item &i: items)  remaining += (i.value >= 0);
+        check(remaining == 0, "the delete took effect");
+    }
+    catch (const std::exception &e) {
+        check(false, string("no exception, but got: ") + e.what());
+    }
+
+    boost::system::error_code ignored;
+    boost::filesystem::remove_all(dir, ignored);
+
+    return report("stream_test");
+}
@@ -0,0 +1,77 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Reads a WAL-mode database through the instrumented VFS with read-ahead, lets another
+// connection commit and checkpoint a change, and checks that the reader sees the change, not
+// what its read-ahead buffer held.  Built and run by `b2 vfs-test`.
+//
+
+#include <iostream>
+#include <string>
+#include <boost/filesystem.hpp>
+#include <sqlite3.h>
+#include <quince_sqlite/settings.h>
+#include <quince_sqlite/detail/connection.h>
+#include <quince_sqlite/detail/instrumented_vfs.h>
+#include "check.h"
+
+using namespace quince_sqlite;
+using namespace quince_sqlite_test;
+using std::string;
+
+
+namespace {
+    connection_spec
+    spec(const string &filename, const boost::optional<string> &vfs, const settings &s) {
+        return connection_spec {
+            filename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_PRIVATECACHE, vfs, s, nullptr, nullptr
+        };
+    }
+}
+
+
+int
+main() {
+    const boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(dir);
+    const string filename = (dir / "wal.db").string();
+
+    try {
+        settings wal;
+        wal._tuning._journal_mode = journal_mode::wal;
+        const string vfs = register_instrumented_vfs(boost::none, 64 << 10);
+
+        connection writer(spec(filename, boost::none, wal));
+        writer.exec("CREATE TABLE t(id INTEGER PRIMARY KEY, v INTEGER, padding BLOB)");
+        writer.exec("CREATE TABLE filler(padding BLOB)");
+        writer.exec(
+            "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < 200) "
+            "INSERT INTO t(v, padding) SELECT 1, zeroblob(100) FROM n"
+        );
+        writer.exec(
+            "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < 100) "
+            "INSERT INTO filler SELECT zeroblob(4000) FROM n"
+        );
+        writer.exec("PRAGMA wal_checkpoint(TRUNCATE)");
+
+        connection reader(spec(filename, vfs, wal));
+        check(single_value(reader.handle(), "SELECT sum(v) FROM t") == "200", "reader sees the original rows");
+        check(get_instrumented_vfs_statistics()[filename]._read_ahead_hits != 0, "the scan was served by read-ahead");
+
+        writer.exec("UPDATE t SET v = 2");
+        writer.exec("PRAGMA wal_checkpoint(TRUNCATE)");
+        check(single_value(writer.handle(), "PRAGMA wal_checkpoint(TRUNCATE)") == "0", "the checkpoint completed");
+
+        check(single_value(reader.handle(), "SELECT sum(v) FROM t") == "400", "reader sees the checkpointed update");
+    }
+    catch (const std::exception &e) {
+        check(false, string("no exception, but got: ") + e.what());
+    }
+
+    boost::system::error_code ignored;
+    boost::filesystem::remove_all(dir, ignored);
+
+    return report("vfs_test");
+}